@@ -0,0 +1,43 @@
+#ifndef PROJET_ALIGNEDALLOCATOR_H
+#define PROJET_ALIGNEDALLOCATOR_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace SoftEngine {
+
+    // Allocator for std::vector whose storage starts on an Alignment byte boundary, for aligned SIMD loads
+    template <typename T, size_t Alignment> struct AlignedAllocator {
+        typedef T value_type;
+        template <typename U> struct rebind {
+            typedef AlignedAllocator<U, Alignment> other;
+        };
+
+        AlignedAllocator() {}
+        template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+        T *allocate(size_t count) {
+            void *memory = NULL;
+            if (posix_memalign(&memory, Alignment, count * sizeof(T)) != 0) throw std::bad_alloc();
+            return (T *) memory;
+        }
+
+        void deallocate(T *memory, size_t) {
+            free(memory);
+        }
+    };
+
+    template <typename T, typename U, size_t Alignment>
+    bool operator==(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> &) {
+        return true;
+    }
+
+    template <typename T, typename U, size_t Alignment>
+    bool operator!=(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> &) {
+        return false;
+    }
+
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include <utility>
+
+#include "asyncwriter.h"
+#include "trace.h"
+
+using namespace SoftEngine;
+
+AsyncImageWriter::AsyncImageWriter(int buffers) {
+    this->buffers = buffers < 1 ? 1 : buffers;
+    inFlight = 0;
+    busy = false;
+    stopping = false;
+    thread = std::thread(&AsyncImageWriter::run, this);
+}
+
+AsyncImageWriter::~AsyncImageWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+}
+
+std::vector<unsigned char> AsyncImageWriter::acquire() {
+    TraceScope traceAcquire("acquire frame buffer", "output");
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]() { return inFlight < buffers; });
+    inFlight++;
+    if (freeBuffers.empty()) {
+        return std::vector<unsigned char>();
+    }
+    std::vector<unsigned char> pixels = std::move(freeBuffers.back());
+    freeBuffers.pop_back();
+    return pixels;
+}
+
+void AsyncImageWriter::submit(std::vector<unsigned char> pixels, EncodeJob encode) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Job job;
+        job.pixels = std::move(pixels);
+        job.encode = std::move(encode);
+        queue.push_back(std::move(job));
+    }
+    changed.notify_all();
+}
+
+void AsyncImageWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]() { return queue.empty() && !busy; });
+}
+
+void AsyncImageWriter::run() {
+    Trace::setThreadName("image writer");
+    int frame = 0;
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            job = std::move(queue.front());
+            queue.pop_front();
+            busy = true;
+        }
+        {
+            TraceScope traceEncode("async encode", "output", frame++);
+            job.encode(job.pixels);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            freeBuffers.push_back(std::move(job.pixels));
+            inFlight--;
+            busy = false;
+        }
+        changed.notify_all();
+    }
+}
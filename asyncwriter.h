@@ -0,0 +1,52 @@
+#ifndef PROJET_ASYNCWRITER_H
+#define PROJET_ASYNCWRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SoftEngine {
+
+    // Background thread that encodes and writes finished frames while the caller renders the next one.
+    // Pixel buffers come from acquire() and go back to a free list once encoded; at most `buffers` of them
+    // exist, so acquire() blocks when the writer falls that many frames behind (2 = double buffering).
+    class AsyncImageWriter {
+
+    public:
+        typedef std::function<void(const std::vector<unsigned char> &pixels)> EncodeJob;
+
+        explicit AsyncImageWriter(int buffers = 2);
+        // Writes every queued frame before returning
+        ~AsyncImageWriter();
+
+        std::vector<unsigned char> acquire();
+        // pixels must come from acquire(), encode runs on the writer thread
+        void submit(std::vector<unsigned char> pixels, EncodeJob encode);
+        // Blocks until every submitted frame is written
+        void flush();
+
+    private:
+        struct Job {
+            std::vector<unsigned char> pixels;
+            EncodeJob encode;
+        };
+
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<Job> queue;
+        std::vector<std::vector<unsigned char> > freeBuffers;
+        int buffers;
+        int inFlight;
+        bool busy;
+        bool stopping;
+
+        void run();
+    };
+
+};
+
+#endif
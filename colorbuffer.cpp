@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <cstring>
+
+#include "colorbuffer.h"
+#include "threadpool.h"
+#include "trace.h"
+
+using namespace SoftEngine;
+
+static unsigned short FloatToHalf(float value)
+{
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    unsigned int sign = (bits >> 16) & 0x8000;
+    int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    unsigned int mantissa = bits & 0x7fffff;
+    if (((bits >> 23) & 0xff) == 0xff) {
+        return (unsigned short)(sign | 0x7c00 | (mantissa ? 0x200 : 0)); // inf or nan
+    }
+    if (exponent >= 31) {
+        return (unsigned short)(sign | 0x7c00);
+    }
+    if (exponent <= 0) {
+        if (exponent < -10) return (unsigned short) sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        unsigned int half = mantissa >> shift;
+        unsigned int rest = mantissa & ((1u << shift) - 1);
+        unsigned int halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return (unsigned short)(sign | half);
+    }
+    // Rounding to nearest even may carry into the exponent, which is still the right result
+    unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+    unsigned int rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return (unsigned short) half;
+}
+
+static float HalfToFloat(unsigned short half)
+{
+    unsigned int sign = (unsigned int)(half & 0x8000) << 16;
+    unsigned int exponent = (half >> 10) & 0x1f;
+    unsigned int mantissa = half & 0x3ff;
+    unsigned int bits;
+    if (exponent == 0) {
+        float value = mantissa * (1.f / 16777216.f);
+        return sign ? -value : value;
+    }
+    if (exponent == 31) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Colors brighter than 1 are scaled back keeping their hue, then clamped
+static Vec3f ToneMap(Vec3f c)
+{
+    float max = std::max(c[0], std::max(c[1], c[2]));
+    if (max > 1) c = c * (1. / max);
+    for (size_t j = 0; j < 3; j++) {
+        c[j] = std::max(0.f, std::min(1.f, c[j]));
+    }
+    return c;
+}
+
+const int ColorBuffer::TILE_SIZE;
+
+ColorBuffer::ColorBuffer(int width, int height, ColorFormat format, ColorLayout layout) {
+    this->format = format;
+    this->layout = layout;
+    this->width = width;
+    this->height = height;
+    tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    // Tiles along the right and bottom edges are allocated whole
+    size_t count = layout == ColorLayout::Tiled ? (size_t) tilesX * tilesY * TILE_SIZE * TILE_SIZE : (size_t) width * height;
+    pixels.resize((count * bytesPerPixel(format) + 7) / 8);
+    cleared.assign((size_t) tilesX * tilesY, 0);
+    clearColor = 0;
+}
+
+ColorFormat ColorBuffer::getFormat() const {
+    return format;
+}
+
+ColorLayout ColorBuffer::getLayout() const {
+    return layout;
+}
+
+int ColorBuffer::getWidth() const {
+    return width;
+}
+
+int ColorBuffer::getHeight() const {
+    return height;
+}
+
+int ColorBuffer::bytesPerPixel(ColorFormat format) {
+    switch (format) {
+        case ColorFormat::RGB565: return 2;
+        case ColorFormat::RGBA16F: return 8;
+        default: return 4;
+    }
+}
+
+size_t ColorBuffer::offset(int x, int y) const {
+    if (layout == ColorLayout::Linear) {
+        return (size_t) y * width + x;
+    }
+    return ((size_t)(y / TILE_SIZE) * tilesX + x / TILE_SIZE) * TILE_SIZE * TILE_SIZE + (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE;
+}
+
+// Writes the pixels of tile (tx, ty) that exist in the layout
+template <typename T> void ColorBuffer::fillTile(int tx, int ty, T value) {
+    T *base = (T *) pixels.data();
+    int x0 = tx * TILE_SIZE;
+    int y0 = ty * TILE_SIZE;
+    int x1 = layout == ColorLayout::Linear ? std::min(width, x0 + TILE_SIZE) : x0 + TILE_SIZE;
+    int y1 = layout == ColorLayout::Linear ? std::min(height, y0 + TILE_SIZE) : y0 + TILE_SIZE;
+    for (int y = y0; y < y1; y++) {
+        std::fill(base + offset(x0, y), base + offset(x1 - 1, y) + 1, value);
+    }
+}
+
+// Fills [x0, x1) of row y as runs that stay within one tile, after giving flagged tiles their clear color
+template <typename T> void ColorBuffer::fill(int y, int x0, int x1, T value) {
+    int ty = y / TILE_SIZE;
+    for (int tx = x0 / TILE_SIZE; tx <= (x1 - 1) / TILE_SIZE; tx++) {
+        unsigned char &flag = cleared[(size_t) ty * tilesX + tx];
+        if (flag) {
+            fillTile<T>(tx, ty, (T) clearColor);
+            flag = 0;
+        }
+    }
+    T *base = (T *) pixels.data();
+    if (layout == ColorLayout::Linear) {
+        std::fill(base + offset(x0, y), base + offset(x1 - 1, y) + 1, value);
+        return;
+    }
+    while (x0 < x1) {
+        int end = std::min(x1, (x0 / TILE_SIZE + 1) * TILE_SIZE);
+        T *run = base + offset(x0, y);
+        std::fill(run, run + (end - x0), value);
+        x0 = end;
+    }
+}
+
+ColorBuffer::Packed ColorBuffer::pack(Vec3f color) const {
+    if (format == ColorFormat::RGBA16F) {
+        return (Packed) FloatToHalf(color.x) | (Packed) FloatToHalf(color.y) << 16 |
+               (Packed) FloatToHalf(color.z) << 32 | (Packed) 0x3c00 << 48; // alpha 1.0
+    }
+    Vec3f c = ToneMap(color);
+    if (format == ColorFormat::RGB565) {
+        return (Packed)((int)(c.x * 31 + 0.5f) << 11 | (int)(c.y * 63 + 0.5f) << 5 | (int)(c.z * 31 + 0.5f));
+    }
+    // Truncated like the conversion to RGB8 always was
+    return (Packed)((unsigned char)(255 * c.x) | (unsigned char)(255 * c.y) << 8 | (unsigned char)(255 * c.z) << 16 | 0xffu << 24);
+}
+
+void ColorBuffer::fillSpan(int y, int x0, int x1, Packed color) {
+    if (y < 0 || y >= height) return;
+    x0 = std::max(x0, 0);
+    x1 = std::min(x1, width);
+    if (x0 >= x1) return;
+    switch (format) {
+        case ColorFormat::RGBA8:
+            fill<uint32_t>(y, x0, x1, (uint32_t) color);
+            break;
+        case ColorFormat::RGB565:
+            fill<uint16_t>(y, x0, x1, (uint16_t) color);
+            break;
+        case ColorFormat::RGBA16F:
+            fill<uint64_t>(y, x0, x1, color);
+            break;
+    }
+}
+
+void ColorBuffer::set(int x, int y, Packed color) {
+    fillSpan(y, x, x + 1, color);
+}
+
+void ColorBuffer::clear(Vec3f color) {
+    TraceScope traceClear("clear", "stage");
+    clearColor = pack(color);
+    std::fill(cleared.begin(), cleared.end(), 1);
+}
+
+static void ConvertPixels(ColorFormat format, const void *pixels, unsigned char *out, int count)
+{
+    if (format == ColorFormat::RGBA8) {
+        const uint32_t *in = (const uint32_t *) pixels;
+        for (int x = 0; x < count; x++) {
+            out[x * 3] = (unsigned char) in[x];
+            out[x * 3 + 1] = (unsigned char)(in[x] >> 8);
+            out[x * 3 + 2] = (unsigned char)(in[x] >> 16);
+        }
+    }
+    else if (format == ColorFormat::RGB565) {
+        const uint16_t *in = (const uint16_t *) pixels;
+        for (int x = 0; x < count; x++) {
+            int r = in[x] >> 11, g = (in[x] >> 5) & 0x3f, b = in[x] & 0x1f;
+            out[x * 3] = (unsigned char)(r << 3 | r >> 2);
+            out[x * 3 + 1] = (unsigned char)(g << 2 | g >> 4);
+            out[x * 3 + 2] = (unsigned char)(b << 3 | b >> 2);
+        }
+    }
+    else {
+        const uint64_t *in = (const uint64_t *) pixels;
+        for (int x = 0; x < count; x++) {
+            Vec3f c = ToneMap(Vec3f(HalfToFloat((unsigned short) in[x]), HalfToFloat((unsigned short)(in[x] >> 16)),
+                                    HalfToFloat((unsigned short)(in[x] >> 32))));
+            for (int j = 0; j < 3; j++) {
+                out[x * 3 + j] = (unsigned char)(255 * c[j]);
+            }
+        }
+    }
+}
+
+// One row of the image, converted a tile row at a time, tiles still flagged as cleared are not read
+void ColorBuffer::resolveRow(int y, unsigned char *rgb) const {
+    uint16_t clear16 = (uint16_t) clearColor;
+    uint32_t clear32 = (uint32_t) clearColor;
+    const void *clearPixel = format == ColorFormat::RGB565 ? (const void *) &clear16 :
+                             format == ColorFormat::RGBA8 ? (const void *) &clear32 : (const void *) &clearColor;
+    unsigned char clearRgb[3];
+    ConvertPixels(format, clearPixel, clearRgb, 1);
+
+    const unsigned char *base = (const unsigned char *) pixels.data();
+    const unsigned char *flags = cleared.data() + (size_t)(y / TILE_SIZE) * tilesX;
+    int bytes = bytesPerPixel(format);
+    for (int x = 0; x < width; x += TILE_SIZE) {
+        int count = std::min(TILE_SIZE, width - x);
+        unsigned char *out = rgb + (size_t) x * 3;
+        if (flags[x / TILE_SIZE]) {
+            for (int i = 0; i < count; i++) {
+                memcpy(out + i * 3, clearRgb, 3);
+            }
+        }
+        else {
+            ConvertPixels(format, base + offset(x, y) * bytes, out, count);
+        }
+    }
+}
+
+void ColorBuffer::resolve(unsigned char *rgb) const {
+    TraceScope traceConvert("convert", "stage");
+    ThreadPool &pool = ThreadPool::shared();
+    int bands = std::min(height, pool.size() * 4);
+    pool.parallelFor("resolve", bands, [&](int band) {
+        int y0 = (int)((long long) height * band / bands);
+        int y1 = (int)((long long) height * (band + 1) / bands);
+        for (int y = y0; y < y1; y++) {
+            resolveRow(y, rgb + (size_t) y * width * 3);
+        }
+    });
+}
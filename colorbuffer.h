@@ -0,0 +1,71 @@
+#ifndef PROJET_COLORBUFFER_H
+#define PROJET_COLORBUFFER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "geometry.h"
+
+namespace SoftEngine {
+
+    enum class ColorFormat {
+        RGBA8,    // 4 bytes, colors brighter than 1 are scaled back when written
+        RGB565,   // 2 bytes, same as RGBA8 with 5/6/5 bits per channel
+        RGBA16F   // 8 bytes of half floats, keeps colors above 1 until resolve
+    };
+
+    enum class ColorLayout {
+        Linear,  // row major
+        Tiled    // 8x8 tiles stored one after the other, rows of tiles in order, pixels row major inside a tile
+    };
+
+    // Color buffer of a Device in one of the compact formats above. A color is packed once, typically
+    // per triangle, and the rasterizer then only stores the packed value. In the tiled layout a tall thin
+    // triangle stays within a few cache lines and pages for 8 scanlines; resolve de-tiles into RGB rows.
+    // clear only flags the 8x8 tiles (in either layout): a flagged tile is filled with the clear color the
+    // first time it is drawn into, and tiles never drawn into are written straight from the clear color by resolve.
+    class ColorBuffer {
+
+    public:
+        // Any of the formats fits in 64 bits
+        typedef uint64_t Packed;
+
+        static const int TILE_SIZE = 8;
+
+        ColorBuffer(int width = 0, int height = 0, ColorFormat format = ColorFormat::RGBA8, ColorLayout layout = ColorLayout::Tiled);
+
+        ColorFormat getFormat() const;
+        ColorLayout getLayout() const;
+        int getWidth() const;
+        int getHeight() const;
+        static int bytesPerPixel(ColorFormat format);
+
+        Packed pack(Vec3f color) const;
+        void clear(Vec3f color);
+        void set(int x, int y, Packed color);
+        // Fills pixels [x0, x1) of row y, the span is clipped to the buffer
+        void fillSpan(int y, int x0, int x1, Packed color);
+        // Converts to width * height * 3 bytes of RGB
+        void resolve(unsigned char *rgb) const;
+
+    private:
+        ColorFormat format;
+        ColorLayout layout;
+        int width;
+        int height;
+        int tilesX;
+        int tilesY;
+        std::vector<uint64_t> pixels;
+        std::vector<unsigned char> cleared;
+        Packed clearColor;
+
+        // Offset of pixel (x, y) in pixels of the format
+        size_t offset(int x, int y) const;
+        template <typename T> void fill(int y, int x0, int x1, T value);
+        template <typename T> void fillTile(int tx, int ty, T value);
+        void resolveRow(int y, unsigned char *rgb) const;
+    };
+
+};
+
+#endif
@@ -34,9 +34,10 @@ template <typename T> struct vec<3,T> {
     vec(T X, T Y, T Z) : x(X), y(Y), z(Z) {}
     T& operator[](const size_t i)       { assert(i<3); return i<=0 ? x : (1==i ? y : z); }
     const T& operator[](const size_t i) const { assert(i<3); return i<=0 ? x : (1==i ? y : z); }
-    float norm() { return std::sqrt(x*x+y*y+z*z); }
-    vec<3,T> & normalize(T l=1) { *this = (*this)*(l/norm()); return *this; }
-    T x = 0,y = 0,z = 0,w = 1;
+    float norm() const { return std::sqrt(x*x+y*y+z*z); }
+    vec<3,T> & normalize(T l=1) { T s = l/norm(); x*=s; y*=s; z*=s; return *this; }
+    // Three packed components, 12 bytes for Vec3f; homogeneous coordinates use vec<4,T>
+    T x,y,z;
 };
 
 template <typename T> struct vec<4,T> {
@@ -79,6 +80,29 @@ template<size_t DIM,typename T> vec<DIM,T> operator-(const vec<DIM,T> &lhs) {
     return lhs*T(-1);
 }
 
+// Unrolled versions of the operators above for 2, 3 and 4 components, picked over the generic loops by overload
+// resolution. Components are combined in the same order as the loops, so results are bit for bit the same.
+
+template<typename T> T operator*(const vec<2,T>& lhs, const vec<2,T>& rhs) { return lhs.y*rhs.y + lhs.x*rhs.x; }
+template<typename T> T operator*(const vec<3,T>& lhs, const vec<3,T>& rhs) { return lhs.z*rhs.z + lhs.y*rhs.y + lhs.x*rhs.x; }
+template<typename T> T operator*(const vec<4,T>& lhs, const vec<4,T>& rhs) { return lhs.w*rhs.w + lhs.z*rhs.z + lhs.y*rhs.y + lhs.x*rhs.x; }
+
+template<typename T> vec<2,T> operator+(const vec<2,T>& lhs, const vec<2,T>& rhs) { return vec<2,T>(lhs.x+rhs.x, lhs.y+rhs.y); }
+template<typename T> vec<3,T> operator+(const vec<3,T>& lhs, const vec<3,T>& rhs) { return vec<3,T>(lhs.x+rhs.x, lhs.y+rhs.y, lhs.z+rhs.z); }
+template<typename T> vec<4,T> operator+(const vec<4,T>& lhs, const vec<4,T>& rhs) { return vec<4,T>(lhs.x+rhs.x, lhs.y+rhs.y, lhs.z+rhs.z, lhs.w+rhs.w); }
+
+template<typename T> vec<2,T> operator-(const vec<2,T>& lhs, const vec<2,T>& rhs) { return vec<2,T>(lhs.x-rhs.x, lhs.y-rhs.y); }
+template<typename T> vec<3,T> operator-(const vec<3,T>& lhs, const vec<3,T>& rhs) { return vec<3,T>(lhs.x-rhs.x, lhs.y-rhs.y, lhs.z-rhs.z); }
+template<typename T> vec<4,T> operator-(const vec<4,T>& lhs, const vec<4,T>& rhs) { return vec<4,T>(lhs.x-rhs.x, lhs.y-rhs.y, lhs.z-rhs.z, lhs.w-rhs.w); }
+
+template<typename T,typename U> vec<2,T> operator*(const vec<2,T> &lhs, const U& rhs) { return vec<2,T>(lhs.x*rhs, lhs.y*rhs); }
+template<typename T,typename U> vec<3,T> operator*(const vec<3,T> &lhs, const U& rhs) { return vec<3,T>(lhs.x*rhs, lhs.y*rhs, lhs.z*rhs); }
+template<typename T,typename U> vec<4,T> operator*(const vec<4,T> &lhs, const U& rhs) { return vec<4,T>(lhs.x*rhs, lhs.y*rhs, lhs.z*rhs, lhs.w*rhs); }
+
+template<typename T,typename U> vec<2,T> operator/(const vec<2,T> &lhs, const U& rhs) { return vec<2,T>(lhs.x/rhs, lhs.y/rhs); }
+template<typename T,typename U> vec<3,T> operator/(const vec<3,T> &lhs, const U& rhs) { return vec<3,T>(lhs.x/rhs, lhs.y/rhs, lhs.z/rhs); }
+template<typename T,typename U> vec<4,T> operator/(const vec<4,T> &lhs, const U& rhs) { return vec<4,T>(lhs.x/rhs, lhs.y/rhs, lhs.z/rhs, lhs.w/rhs); }
+
 template <typename T> vec<3,T> cross(vec<3,T> v1, vec<3,T> v2) {
     return vec<3,T>(v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x);
 }
@@ -0,0 +1,724 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define JPEG_SIMD_X86
+#include <immintrin.h>
+#endif
+
+static void JpegDctQuantize(float *CDU, const float *fdtbl, int *DU);
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STBIW_JPG_DCT_QUANTIZE JpegDctQuantize
+#include "imagewriter.h"
+#include "threadpool.h"
+#include "trace.h"
+
+// Strips per thread, more strips than threads keeps the workers busy when some strips are cheaper than others
+#define JPEG_STRIPS_PER_THREAD 4
+// PNG rows are deflated in groups of at least this many filtered bytes, smaller groups lose too much ratio
+#define PNG_MIN_GROUP_BYTES (256 * 1024)
+#define PNG_GROUPS_PER_THREAD 2
+
+using namespace SoftEngine;
+
+#ifdef JPEG_SIMD_X86
+
+// stbiw__jpg_DCT on whole vectors: every lane is an independent row (or column) of the block.
+// Same operations in the same order as the scalar version, so results are bit identical.
+template <typename V>
+static inline __attribute__((always_inline)) void DctButterfly(V &d0, V &d1, V &d2, V &d3, V &d4, V &d5, V &d6, V &d7)
+{
+    V tmp0 = d0 + d7;
+    V tmp7 = d0 - d7;
+    V tmp1 = d1 + d6;
+    V tmp6 = d1 - d6;
+    V tmp2 = d2 + d5;
+    V tmp5 = d2 - d5;
+    V tmp3 = d3 + d4;
+    V tmp4 = d3 - d4;
+
+    // Even part
+    V tmp10 = tmp0 + tmp3;
+    V tmp13 = tmp0 - tmp3;
+    V tmp11 = tmp1 + tmp2;
+    V tmp12 = tmp1 - tmp2;
+
+    d0 = tmp10 + tmp11;
+    d4 = tmp10 - tmp11;
+
+    V z1 = (tmp12 + tmp13) * 0.707106781f;
+    d2 = tmp13 + z1;
+    d6 = tmp13 - z1;
+
+    // Odd part
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+
+    V z5 = (tmp10 - tmp12) * 0.382683433f;
+    V z2 = tmp10 * 0.541196100f + z5;
+    V z4 = tmp12 * 1.306562965f + z5;
+    V z3 = tmp11 * 0.707106781f;
+
+    V z11 = tmp7 + z3;
+    V z13 = tmp7 - z3;
+
+    d5 = z13 + z2;
+    d3 = z13 - z2;
+    d1 = z11 + z4;
+    d7 = z11 - z4;
+}
+
+// q holds the quantized coefficients in natural order
+static inline void ZigZagScatter(const int *q, int *DU)
+{
+    for (int i = 0; i < 64; i++) {
+        DU[stbiw__jpg_ZigZag[i]] = q[i];
+    }
+}
+
+static void DctQuantizeSse2(float *CDU, const float *fdtbl, int *DU)
+{
+    // Rows, four at a time: transpose so that each register holds one column of four rows
+    for (int g = 0; g < 64; g += 32) {
+        __m128 a0 = _mm_loadu_ps(CDU + g), b0 = _mm_loadu_ps(CDU + g + 4);
+        __m128 a1 = _mm_loadu_ps(CDU + g + 8), b1 = _mm_loadu_ps(CDU + g + 12);
+        __m128 a2 = _mm_loadu_ps(CDU + g + 16), b2 = _mm_loadu_ps(CDU + g + 20);
+        __m128 a3 = _mm_loadu_ps(CDU + g + 24), b3 = _mm_loadu_ps(CDU + g + 28);
+        _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+        _MM_TRANSPOSE4_PS(b0, b1, b2, b3);
+        DctButterfly(a0, a1, a2, a3, b0, b1, b2, b3);
+        _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+        _MM_TRANSPOSE4_PS(b0, b1, b2, b3);
+        _mm_storeu_ps(CDU + g, a0); _mm_storeu_ps(CDU + g + 4, b0);
+        _mm_storeu_ps(CDU + g + 8, a1); _mm_storeu_ps(CDU + g + 12, b1);
+        _mm_storeu_ps(CDU + g + 16, a2); _mm_storeu_ps(CDU + g + 20, b2);
+        _mm_storeu_ps(CDU + g + 24, a3); _mm_storeu_ps(CDU + g + 28, b3);
+    }
+    // Columns, four at a time: rows are already laid out one column per lane
+    for (int h = 0; h < 8; h += 4) {
+        __m128 d0 = _mm_loadu_ps(CDU + h), d1 = _mm_loadu_ps(CDU + h + 8);
+        __m128 d2 = _mm_loadu_ps(CDU + h + 16), d3 = _mm_loadu_ps(CDU + h + 24);
+        __m128 d4 = _mm_loadu_ps(CDU + h + 32), d5 = _mm_loadu_ps(CDU + h + 40);
+        __m128 d6 = _mm_loadu_ps(CDU + h + 48), d7 = _mm_loadu_ps(CDU + h + 56);
+        DctButterfly(d0, d1, d2, d3, d4, d5, d6, d7);
+        _mm_storeu_ps(CDU + h, d0); _mm_storeu_ps(CDU + h + 8, d1);
+        _mm_storeu_ps(CDU + h + 16, d2); _mm_storeu_ps(CDU + h + 24, d3);
+        _mm_storeu_ps(CDU + h + 32, d4); _mm_storeu_ps(CDU + h + 40, d5);
+        _mm_storeu_ps(CDU + h + 48, d6); _mm_storeu_ps(CDU + h + 56, d7);
+    }
+
+    alignas(16) int q[64];
+    const __m128 half = _mm_set1_ps(0.5f), sign = _mm_set1_ps(-0.0f);
+    for (int i = 0; i < 64; i += 4) {
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(CDU + i), _mm_loadu_ps(fdtbl + i));
+        v = _mm_add_ps(v, _mm_or_ps(_mm_and_ps(v, sign), half));
+        _mm_store_si128((__m128i *)(q + i), _mm_cvttps_epi32(v));
+    }
+    ZigZagScatter(q, DU);
+}
+
+__attribute__((target("avx2"))) static inline void Transpose8x8(__m256 &r0, __m256 &r1, __m256 &r2, __m256 &r3,
+                                                                __m256 &r4, __m256 &r5, __m256 &r6, __m256 &r7)
+{
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+    __m256 t4 = _mm256_unpacklo_ps(r4, r5), t5 = _mm256_unpackhi_ps(r4, r5);
+    __m256 t6 = _mm256_unpacklo_ps(r6, r7), t7 = _mm256_unpackhi_ps(r6, r7);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)), s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)), s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0)), s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0)), s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    r0 = _mm256_permute2f128_ps(s0, s4, 0x20); r4 = _mm256_permute2f128_ps(s0, s4, 0x31);
+    r1 = _mm256_permute2f128_ps(s1, s5, 0x20); r5 = _mm256_permute2f128_ps(s1, s5, 0x31);
+    r2 = _mm256_permute2f128_ps(s2, s6, 0x20); r6 = _mm256_permute2f128_ps(s2, s6, 0x31);
+    r3 = _mm256_permute2f128_ps(s3, s7, 0x20); r7 = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+// Whole block in registers: transpose, row pass, transpose back, column pass
+__attribute__((target("avx2"))) static void DctQuantizeAvx2(float *CDU, const float *fdtbl, int *DU)
+{
+    __m256 r0 = _mm256_loadu_ps(CDU), r1 = _mm256_loadu_ps(CDU + 8);
+    __m256 r2 = _mm256_loadu_ps(CDU + 16), r3 = _mm256_loadu_ps(CDU + 24);
+    __m256 r4 = _mm256_loadu_ps(CDU + 32), r5 = _mm256_loadu_ps(CDU + 40);
+    __m256 r6 = _mm256_loadu_ps(CDU + 48), r7 = _mm256_loadu_ps(CDU + 56);
+    Transpose8x8(r0, r1, r2, r3, r4, r5, r6, r7);
+    DctButterfly(r0, r1, r2, r3, r4, r5, r6, r7);
+    Transpose8x8(r0, r1, r2, r3, r4, r5, r6, r7);
+    DctButterfly(r0, r1, r2, r3, r4, r5, r6, r7);
+
+    alignas(32) int q[64];
+    const __m256 half = _mm256_set1_ps(0.5f), sign = _mm256_set1_ps(-0.0f);
+    __m256 rows[8] = { r0, r1, r2, r3, r4, r5, r6, r7 };
+    for (int j = 0; j < 8; j++) {
+        __m256 v = _mm256_mul_ps(rows[j], _mm256_loadu_ps(fdtbl + j * 8));
+        v = _mm256_add_ps(v, _mm256_or_ps(_mm256_and_ps(v, sign), half));
+        _mm256_store_si256((__m256i *)(q + j * 8), _mm256_cvttps_epi32(v));
+    }
+    ZigZagScatter(q, DU);
+}
+
+#endif
+
+typedef void (*DctQuantizeFunc)(float *CDU, const float *fdtbl, int *DU);
+
+static DctQuantizeFunc SelectDctQuantize()
+{
+#ifdef JPEG_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return DctQuantizeAvx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return DctQuantizeSse2;
+    }
+#endif
+    return stbiw__jpg_DCT_quantize;
+}
+
+// Picked once from the CPU features on the first block
+static void JpegDctQuantize(float *CDU, const float *fdtbl, int *DU)
+{
+    static const DctQuantizeFunc impl = SelectDctQuantize();
+    impl(CDU, fdtbl, DU);
+}
+
+static void AppendToVector(void *context, void *data, int size)
+{
+    std::vector<unsigned char> *out = (std::vector<unsigned char> *) context;
+    out->insert(out->end(), (unsigned char *) data, (unsigned char *) data + size);
+}
+
+ImageSink::ImageSink(stbi_write_func *func, void *context) {
+    this->func = func;
+    this->context = context;
+    this->file = NULL;
+}
+
+ImageSink ImageSink::memory(std::vector<unsigned char> &buffer) {
+    return ImageSink(AppendToVector, &buffer);
+}
+
+ImageSink ImageSink::stream(FILE *file) {
+    ImageSink sink(stbi__stdio_write, file);
+    sink.file = file;
+    return sink;
+}
+
+// The stdio callback cannot fail, so a short write to a stream only shows once it is flushed
+static int FinishSink(const ImageSink &sink, int result)
+{
+    if (sink.file != NULL && (fflush(sink.file) != 0 || ferror(sink.file))) {
+        return 0;
+    }
+    return result;
+}
+
+JpegEncoder::JpegEncoder(int quality, ChromaSubsampling subsampling) {
+    this->quality = quality;
+    this->subsampling = subsampling;
+    stbiw__jpg_init_tables(quality, YTable, UVTable, fdtbl_Y, fdtbl_UV);
+}
+
+int JpegEncoder::getQuality() const {
+    return quality;
+}
+
+ChromaSubsampling JpegEncoder::getSubsampling() const {
+    return subsampling;
+}
+
+int JpegEncoder::write_to_func(stbi_write_func *func, void *context, int width, int height, int comp, const void *data) const {
+    if (!data || !width || !height || comp > 4 || comp < 1) {
+        return 0;
+    }
+
+    ThreadPool &pool = ThreadPool::shared();
+    int subsample = subsampling == ChromaSubsampling::Yuv420 ? 1 : 0;
+    int mcuSize = subsample ? 16 : 8;
+    int mcusPerRow = (width + mcuSize - 1) / mcuSize;
+    int mcuRows = (height + mcuSize - 1) / mcuSize;
+
+    // The restart interval is a 16 bit count of MCUs, a single thread gains nothing from restart markers
+    int strips = 1;
+    int stripRows = mcuRows;
+    if (pool.size() > 1 && mcuRows > 1 && mcusPerRow <= 0xFFFF) {
+        stripRows = std::max(1, (mcuRows + pool.size() * JPEG_STRIPS_PER_THREAD - 1) / (pool.size() * JPEG_STRIPS_PER_THREAD));
+        stripRows = std::min(stripRows, 0xFFFF / mcusPerRow);
+        strips = (mcuRows + stripRows - 1) / stripRows;
+    }
+
+    // Strips are encoded into memory and handed to func in one call each, not byte by byte
+    std::vector<std::vector<unsigned char> > segments(strips);
+    pool.parallelFor("jpeg strip", strips, [&](int i) {
+        stbi__write_context strip;
+        stbi__start_write_callbacks(&strip, AppendToVector, &segments[i]);
+        segments[i].reserve((size_t) stripRows * mcuSize * width * comp / 4);
+        int y0 = i * stripRows * mcuSize;
+        int y1 = std::min(height, y0 + stripRows * mcuSize);
+        stbiw__jpg_encode_rows(&strip, width, height, comp, data, subsample, y0, y1, fdtbl_Y, fdtbl_UV);
+    });
+
+    TraceScope traceOutput("jpeg output", "stage");
+    stbi__write_context s;
+    stbi__start_write_callbacks(&s, func, context);
+    stbiw__jpg_write_headers(&s, width, height, YTable, UVTable, subsample, strips > 1 ? stripRows * mcusPerRow : 0);
+    for (int i = 0; i < strips; i++) {
+        if (i > 0) {
+            stbiw__putc(&s, 0xFF);
+            stbiw__putc(&s, (unsigned char)(0xD0 + ((i - 1) & 7))); // RST0 ... RST7
+        }
+        if (!segments[i].empty()) {
+            s.func(s.context, segments[i].data(), (int) segments[i].size());
+        }
+    }
+
+    // EOI
+    stbiw__putc(&s, 0xFF);
+    stbiw__putc(&s, 0xD9);
+    return 1;
+}
+
+int JpegEncoder::write(const ImageSink &sink, int width, int height, int comp, const void *data) const {
+    return FinishSink(sink, write_to_func(sink.func, sink.context, width, height, comp, data));
+}
+
+// Opens filename and hands the stdio callback to write, failing as well when the data does not all reach the file
+template <typename Writer>
+static int WriteToFile(const char *filename, Writer write)
+{
+    stbi__write_context s;
+    if (!stbi__start_write_file(&s, filename)) {
+        std::fprintf(stderr, "Failed to open %s\n", filename);
+        return 0;
+    }
+    FILE *file = (FILE *) s.context;
+    int r = write(s.func, s.context);
+    if (ferror(file)) r = 0;
+    if (fclose(file) != 0) r = 0;
+    return r;
+}
+
+int JpegEncoder::write(const char *filename, int width, int height, int comp, const void *data) const {
+    return WriteToFile(filename, [&](stbi_write_func *func, void *context) {
+        return write_to_func(func, context, width, height, comp, data);
+    });
+}
+
+// Candidate filters with their PNG filter type byte, None and Average rarely win on rendered images
+#define PNG_CANDIDATES 3
+static const unsigned char PngFilterTypes[PNG_CANDIDATES] = { 1, 2, 4 }; // Sub, Up, Paeth
+
+// Filters bytes [from, count) of row z, whose previous row is above, into out and adds the absolute residuals to sums
+static void PngFilterScalar(const unsigned char *z, const unsigned char *above, int n, int from, int count,
+                            unsigned char *const out[PNG_CANDIDATES], unsigned int sums[PNG_CANDIDATES])
+{
+    for (int i = from; i < count; i++) {
+        int a = i >= n ? z[i - n] : 0;
+        int b = above[i];
+        int c = i >= n ? above[i - n] : 0;
+        unsigned char residual[PNG_CANDIDATES] = {
+            (unsigned char)(z[i] - a),
+            (unsigned char)(z[i] - b),
+            (unsigned char)(z[i] - stbiw__paeth(a, b, c))
+        };
+        for (int k = 0; k < PNG_CANDIDATES; k++) {
+            out[k][i] = residual[k];
+            sums[k] += abs((signed char) residual[k]);
+        }
+    }
+}
+
+#ifdef JPEG_SIMD_X86
+
+// |x| of eight signed 16 bit lanes
+static inline __m128i Abs16(__m128i x)
+{
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+// stbiw__paeth on eight 16 bit lanes: pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|, ties prefer a then b
+static inline __m128i Paeth16(__m128i a, __m128i b, __m128i c)
+{
+    __m128i bc = _mm_sub_epi16(b, c);
+    __m128i ac = _mm_sub_epi16(a, c);
+    __m128i pa = Abs16(bc);
+    __m128i pb = Abs16(ac);
+    __m128i pc = Abs16(_mm_add_epi16(ac, bc));
+    __m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    __m128i notB = _mm_cmpgt_epi16(pb, pc);
+    __m128i bOrC = _mm_or_si128(_mm_and_si128(notB, c), _mm_andnot_si128(notB, b));
+    return _mm_or_si128(_mm_and_si128(notA, bOrC), _mm_andnot_si128(notA, a));
+}
+
+// Adds the absolute values of 16 signed residuals to the two 64 bit lanes of sum
+static inline __m128i SumAbs8(__m128i sum, __m128i residual)
+{
+    __m128i magnitude = _mm_min_epu8(residual, _mm_sub_epi8(_mm_setzero_si128(), residual));
+    return _mm_add_epi64(sum, _mm_sad_epu8(magnitude, _mm_setzero_si128()));
+}
+
+static void PngFilterRow(const unsigned char *z, const unsigned char *above, int n, int count,
+                         unsigned char *const out[PNG_CANDIDATES], unsigned int sums[PNG_CANDIDATES])
+{
+    // The first pixel has no left neighbour
+    int head = std::min(n, count);
+    PngFilterScalar(z, above, n, 0, head, out, sums);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sumSub = zero, sumUp = zero, sumPaeth = zero;
+    int i = head;
+    for (; i + 16 <= count; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(z + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(z + i - n));
+        __m128i b = _mm_loadu_si128((const __m128i *)(above + i));
+        __m128i c = _mm_loadu_si128((const __m128i *)(above + i - n));
+        __m128i pl = Paeth16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+        __m128i ph = Paeth16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+        __m128i sub = _mm_sub_epi8(x, a);
+        __m128i up = _mm_sub_epi8(x, b);
+        __m128i paeth = _mm_sub_epi8(x, _mm_packus_epi16(pl, ph));
+        _mm_storeu_si128((__m128i *)(out[0] + i), sub);
+        _mm_storeu_si128((__m128i *)(out[1] + i), up);
+        _mm_storeu_si128((__m128i *)(out[2] + i), paeth);
+        sumSub = SumAbs8(sumSub, sub);
+        sumUp = SumAbs8(sumUp, up);
+        sumPaeth = SumAbs8(sumPaeth, paeth);
+    }
+    sums[0] += _mm_cvtsi128_si32(sumSub) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sumSub, sumSub));
+    sums[1] += _mm_cvtsi128_si32(sumUp) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sumUp, sumUp));
+    sums[2] += _mm_cvtsi128_si32(sumPaeth) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sumPaeth, sumPaeth));
+    PngFilterScalar(z, above, n, i, count, out, sums);
+}
+
+#else
+
+static void PngFilterRow(const unsigned char *z, const unsigned char *above, int n, int count,
+                         unsigned char *const out[PNG_CANDIDATES], unsigned int sums[PNG_CANDIDATES])
+{
+    PngFilterScalar(z, above, n, 0, count, out, sums);
+}
+
+#endif
+
+// zlib's adler32_combine: the adler32 of A followed by B, from those of A and B and the length of B
+static unsigned int Adler32Combine(unsigned int adler1, unsigned int adler2, size_t length2)
+{
+    const unsigned int base = 65521;
+    unsigned int rem = (unsigned int)(length2 % base);
+    unsigned int sum1 = adler1 & 0xffff;
+    unsigned int sum2 = (unsigned int)((unsigned long long) rem * sum1 % base);
+    sum1 += (adler2 & 0xffff) + base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= 2 * base) sum2 -= 2 * base;
+    if (sum2 >= base) sum2 -= base;
+    return sum1 | (sum2 << 16);
+}
+
+static void PngPut32(std::vector<unsigned char> &out, unsigned int v)
+{
+    unsigned char bytes[4] = { (unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char) v };
+    out.insert(out.end(), bytes, bytes + 4);
+}
+
+// Fills in the length and appends the CRC of a chunk started with PngPut32(0) and its tag
+static void PngEndChunk(std::vector<unsigned char> &chunk)
+{
+    unsigned int length = (unsigned int)(chunk.size() - 8);
+    for (int i = 0; i < 4; i++) {
+        chunk[i] = (unsigned char)(length >> (24 - 8 * i));
+    }
+    PngPut32(chunk, stbiw__crc32(chunk.data() + 4, (int) length + 4));
+}
+
+PngEncoder::PngEncoder(int compression) {
+    this->compression = compression;
+}
+
+int PngEncoder::getCompression() const {
+    return compression;
+}
+
+int PngEncoder::write_to_func(stbi_write_func *func, void *context, int width, int height, int comp, const void *data) const {
+    if (!data || width <= 0 || height <= 0 || comp > 4 || comp < 1) {
+        return 0;
+    }
+
+    ThreadPool &pool = ThreadPool::shared();
+    const unsigned char *pixels = (const unsigned char *) data;
+    int rowBytes = width * comp;
+    size_t filteredRow = (size_t) rowBytes + 1;
+    size_t total = filteredRow * height;
+    if (total > 0x7fffffff) {
+        return 0;
+    }
+
+    int groups = (int) std::min<size_t>(std::min(height, pool.size() * PNG_GROUPS_PER_THREAD),
+                                        std::max<size_t>(1, total / PNG_MIN_GROUP_BYTES));
+    int groupRows = (height + groups - 1) / groups;
+    groups = (height + groupRows - 1) / groupRows;
+
+    std::vector<unsigned char> filtered(total);
+    std::vector<unsigned char> zeroRow(rowBytes, 0);
+    pool.parallelFor("png filter", groups, [&](int g) {
+        std::vector<unsigned char> scratch((size_t) rowBytes * PNG_CANDIDATES);
+        unsigned char *const candidates[PNG_CANDIDATES] = { scratch.data(), scratch.data() + rowBytes, scratch.data() + 2 * rowBytes };
+        int y1 = std::min(height, (g + 1) * groupRows);
+        for (int y = g * groupRows; y < y1; y++) {
+            int row = stbi__flip_vertically_on_write ? height - 1 - y : y;
+            int previous = stbi__flip_vertically_on_write ? row + 1 : row - 1;
+            const unsigned char *above = y == 0 ? zeroRow.data() : pixels + (size_t) previous * rowBytes;
+            unsigned int sums[PNG_CANDIDATES] = { 0, 0, 0 };
+            PngFilterRow(pixels + (size_t) row * rowBytes, above, comp, rowBytes, candidates, sums);
+            int best = 0;
+            for (int k = 1; k < PNG_CANDIDATES; k++) {
+                if (sums[k] < sums[best]) best = k;
+            }
+            unsigned char *out = filtered.data() + y * filteredRow;
+            out[0] = PngFilterTypes[best];
+            memcpy(out + 1, candidates[best], rowBytes);
+        }
+    });
+
+    // One IDAT chunk per group, the zlib header goes in the first and the adler32 at the end of the last
+    std::vector<std::vector<unsigned char> > chunks(groups);
+    std::vector<unsigned int> adlers(groups);
+    std::atomic<bool> failed(false);
+    pool.parallelFor("png deflate", groups, [&](int g) {
+        int start = (int)(g * groupRows * filteredRow);
+        int end = (int)(std::min(height, (g + 1) * groupRows) * filteredRow);
+        bool last = g == groups - 1;
+        int length;
+        unsigned char *deflate = stbiw__zlib_compress_range(filtered.data(), start, end, last, compression, &length);
+        if (deflate == NULL) {
+            failed = true;
+            return;
+        }
+        std::vector<unsigned char> &chunk = chunks[g];
+        chunk.reserve(length + 18);
+        PngPut32(chunk, 0);
+        chunk.insert(chunk.end(), { 'I', 'D', 'A', 'T' });
+        if (g == 0) {
+            chunk.push_back(0x78); // DEFLATE 32K window
+            chunk.push_back(0x5e); // FLEVEL = 1
+        }
+        chunk.insert(chunk.end(), deflate, deflate + length);
+        STBIW_FREE(deflate);
+        adlers[g] = stbiw__adler32(filtered.data() + start, end - start);
+        if (!last) {
+            PngEndChunk(chunk);
+        }
+    });
+    if (failed) {
+        return 0;
+    }
+
+    TraceScope traceOutput("png output", "stage");
+    unsigned int adler = 1;
+    for (int g = 0; g < groups; g++) {
+        int rows = std::min(height, (g + 1) * groupRows) - g * groupRows;
+        adler = Adler32Combine(adler, adlers[g], rows * filteredRow);
+    }
+    PngPut32(chunks.back(), adler);
+    PngEndChunk(chunks.back());
+
+    static const int colorTypes[5] = { -1, 0, 4, 2, 6 };
+    std::vector<unsigned char> header = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    std::vector<unsigned char> ihdr;
+    PngPut32(ihdr, 0);
+    ihdr.insert(ihdr.end(), { 'I', 'H', 'D', 'R' });
+    PngPut32(ihdr, (unsigned int) width);
+    PngPut32(ihdr, (unsigned int) height);
+    ihdr.insert(ihdr.end(), { 8, (unsigned char) colorTypes[comp], 0, 0, 0 });
+    PngEndChunk(ihdr);
+    header.insert(header.end(), ihdr.begin(), ihdr.end());
+    func(context, header.data(), (int) header.size());
+    for (int g = 0; g < groups; g++) {
+        func(context, chunks[g].data(), (int) chunks[g].size());
+    }
+
+    std::vector<unsigned char> iend;
+    PngPut32(iend, 0);
+    iend.insert(iend.end(), { 'I', 'E', 'N', 'D' });
+    PngEndChunk(iend);
+    func(context, iend.data(), (int) iend.size());
+    return 1;
+}
+
+int PngEncoder::write(const ImageSink &sink, int width, int height, int comp, const void *data) const {
+    return FinishSink(sink, write_to_func(sink.func, sink.context, width, height, comp, data));
+}
+
+int PngEncoder::write(const char *filename, int width, int height, int comp, const void *data) const {
+    return WriteToFile(filename, [&](stbi_write_func *func, void *context) {
+        return write_to_func(func, context, width, height, comp, data);
+    });
+}
+
+ImageFormat SoftEngine::image_format_from_filename(const std::string &filename) {
+    size_t dot = filename.find_last_of('.');
+    std::string extension = dot == std::string::npos ? "" : filename.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension == "png") return ImageFormat::Png;
+    if (extension == "qoi") return ImageFormat::Qoi;
+    if (extension == "pgm" || extension == "ppm" || extension == "pam" || extension == "pnm") return ImageFormat::Pnm;
+    return ImageFormat::Jpeg;
+}
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+
+static inline unsigned char *QoiPut32(unsigned char *out, unsigned int v)
+{
+    out[0] = (unsigned char)(v >> 24);
+    out[1] = (unsigned char)(v >> 16);
+    out[2] = (unsigned char)(v >> 8);
+    out[3] = (unsigned char) v;
+    return out + 4;
+}
+
+int SoftEngine::write_qoi_to_func(stbi_write_func *func, void *context, int width, int height, int comp, const void *data) {
+    if (!data || width <= 0 || height <= 0 || comp > 4 || comp < 1) {
+        return 0;
+    }
+    TraceScope traceEncode("qoi encode", "stage");
+    const unsigned char *pixels = (const unsigned char *) data;
+    int channels = comp == 2 || comp == 4 ? 4 : 3;
+    size_t count = (size_t) width * height;
+
+    // Worst case every pixel is a QOI_OP_RGB(A) chunk
+    std::vector<unsigned char> buffer(14 + count * (channels + 1) + 8);
+    unsigned char *out = buffer.data();
+    *out++ = 'q'; *out++ = 'o'; *out++ = 'i'; *out++ = 'f';
+    out = QoiPut32(out, (unsigned int) width);
+    out = QoiPut32(out, (unsigned int) height);
+    *out++ = (unsigned char) channels;
+    *out++ = 0; // sRGB with linear alpha
+
+    unsigned char index[64][4] = {};
+    unsigned char prev[4] = { 0, 0, 0, 255 };
+    int run = 0;
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char *p = pixels + i * comp;
+        unsigned char px[4];
+        if (comp >= 3) {
+            px[0] = p[0]; px[1] = p[1]; px[2] = p[2];
+            px[3] = comp == 4 ? p[3] : 255;
+        }
+        else {
+            px[0] = px[1] = px[2] = p[0];
+            px[3] = comp == 2 ? p[1] : 255;
+        }
+
+        if (px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2] && px[3] == prev[3]) {
+            run++;
+            if (run == 62 || i == count - 1) {
+                *out++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            *out++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+            run = 0;
+        }
+
+        int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+        if (index[hash][0] == px[0] && index[hash][1] == px[1] && index[hash][2] == px[2] && index[hash][3] == px[3]) {
+            *out++ = (unsigned char)(QOI_OP_INDEX | hash);
+        }
+        else {
+            index[hash][0] = px[0]; index[hash][1] = px[1]; index[hash][2] = px[2]; index[hash][3] = px[3];
+            if (px[3] == prev[3]) {
+                signed char vr = (signed char)(px[0] - prev[0]);
+                signed char vg = (signed char)(px[1] - prev[1]);
+                signed char vb = (signed char)(px[2] - prev[2]);
+                signed char vg_r = (signed char)(vr - vg);
+                signed char vg_b = (signed char)(vb - vg);
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                    *out++ = (unsigned char)(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                }
+                else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                    *out++ = (unsigned char)(QOI_OP_LUMA | (vg + 32));
+                    *out++ = (unsigned char)((vg_r + 8) << 4 | (vg_b + 8));
+                }
+                else {
+                    *out++ = QOI_OP_RGB;
+                    *out++ = px[0]; *out++ = px[1]; *out++ = px[2];
+                }
+            }
+            else {
+                *out++ = QOI_OP_RGBA;
+                *out++ = px[0]; *out++ = px[1]; *out++ = px[2]; *out++ = px[3];
+            }
+        }
+        prev[0] = px[0]; prev[1] = px[1]; prev[2] = px[2]; prev[3] = px[3];
+    }
+    static const unsigned char padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    for (int i = 0; i < 8; i++) {
+        *out++ = padding[i];
+    }
+
+    func(context, buffer.data(), (int)(out - buffer.data()));
+    return 1;
+}
+
+int SoftEngine::write_qoi(const char *filename, int width, int height, int comp, const void *data) {
+    return WriteToFile(filename, [&](stbi_write_func *func, void *context) {
+        return write_qoi_to_func(func, context, width, height, comp, data);
+    });
+}
+
+int SoftEngine::write_pnm_to_func(stbi_write_func *func, void *context, int width, int height, int comp, const void *data) {
+    if (!data || width <= 0 || height <= 0 || comp > 4 || comp < 1) {
+        return 0;
+    }
+    TraceScope traceEncode("pnm dump", "stage");
+    char header[128];
+    int length;
+    if (comp == 1 || comp == 3) {
+        length = std::snprintf(header, sizeof(header), "P%d\n%d %d\n255\n", comp == 1 ? 5 : 6, width, height);
+    }
+    else {
+        length = std::snprintf(header, sizeof(header), "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+                               width, height, comp, comp == 2 ? "GRAYSCALE_ALPHA" : "RGB_ALPHA");
+    }
+    func(context, header, length);
+    func(context, (void *) data, width * height * comp);
+    return 1;
+}
+
+int SoftEngine::write_pnm(const char *filename, int width, int height, int comp, const void *data) {
+    return WriteToFile(filename, [&](stbi_write_func *func, void *context) {
+        return write_pnm_to_func(func, context, width, height, comp, data);
+    });
+}
+
+int SoftEngine::write_image(const ImageSink &sink, ImageFormat format, const JpegEncoder &jpeg, int width, int height, int comp, const void *data) {
+    switch (format) {
+        case ImageFormat::Png:
+            return PngEncoder(stbi_write_png_compression_level).write(sink, width, height, comp, data);
+        case ImageFormat::Qoi:
+            return FinishSink(sink, write_qoi_to_func(sink.func, sink.context, width, height, comp, data));
+        case ImageFormat::Pnm:
+            return FinishSink(sink, write_pnm_to_func(sink.func, sink.context, width, height, comp, data));
+        default:
+            return jpeg.write(sink, width, height, comp, data);
+    }
+}
+
+int SoftEngine::write_image(const char *filename, ImageFormat format, const JpegEncoder &jpeg, int width, int height, int comp, const void *data) {
+    return WriteToFile(filename, [&](stbi_write_func *func, void *context) {
+        return write_image(ImageSink(func, context), format, jpeg, width, height, comp, data);
+    });
+}
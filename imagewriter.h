@@ -0,0 +1,100 @@
+#ifndef PROJET_IMAGEWRITER_H
+#define PROJET_IMAGEWRITER_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "stb_image_write.h"
+
+namespace SoftEngine {
+
+    // Where encoded bytes go: any stbi_write_func callback with its context
+    struct ImageSink {
+        stbi_write_func *func;
+        void *context;
+        // The stream of a sink from stream(), flushed and checked for errors after each image, NULL otherwise
+        FILE *file;
+
+        ImageSink(stbi_write_func *func, void *context);
+        // Appends to buffer, which must outlive the writes
+        static ImageSink memory(std::vector<unsigned char> &buffer);
+        // Writes to an already open stream such as stdout or a popen() pipe, the caller keeps ownership
+        static ImageSink stream(FILE *file);
+    };
+
+    enum class ChromaSubsampling {
+        Yuv444,
+        Yuv420
+    };
+
+    // JPEG encoder built once for a quality and a chroma subsampling, then reused for every frame.
+    // The image is cut into horizontal strips of MCU rows separated by restart markers, and the strips
+    // are entropy-coded in parallel on ThreadPool::shared(). The decoded image matches stbi_write_jpg
+    // for the same quality in 4:4:4, the bytes only match on a single thread where no restart markers
+    // are written. An encoder is never modified by write, so threads can share one.
+    class JpegEncoder {
+
+    public:
+        JpegEncoder(int quality = 90, ChromaSubsampling subsampling = ChromaSubsampling::Yuv444);
+
+        int getQuality() const;
+        ChromaSubsampling getSubsampling() const;
+
+        int write(const char *filename, int width, int height, int comp, const void *data) const;
+        int write(const ImageSink &sink, int width, int height, int comp, const void *data) const;
+        int write_to_func(stbi_write_func *func, void *context, int width, int height, int comp, const void *data) const;
+
+    private:
+        int quality;
+        ChromaSubsampling subsampling;
+        unsigned char YTable[64];
+        unsigned char UVTable[64];
+        float fdtbl_Y[64];
+        float fdtbl_UV[64];
+    };
+
+    // PNG encoder for lossless frames. Each row gets the cheapest of the Sub, Up and Paeth filters by sum of
+    // absolute residuals, computed with SSE2, instead of stbi_write_png trying all five filters. Rows are then cut
+    // into groups deflated in parallel on ThreadPool::shared(): a group may still match into the 32K before it and
+    // ends on a sync flush, so the groups join into one zlib stream, each written as its own IDAT chunk.
+    class PngEncoder {
+
+    public:
+        // compression is stb's hash chain length, see stbi_write_png_compression_level
+        PngEncoder(int compression = 8);
+
+        int getCompression() const;
+
+        int write(const char *filename, int width, int height, int comp, const void *data) const;
+        int write(const ImageSink &sink, int width, int height, int comp, const void *data) const;
+        int write_to_func(stbi_write_func *func, void *context, int width, int height, int comp, const void *data) const;
+
+    private:
+        int compression;
+    };
+
+    enum class ImageFormat {
+        Jpeg,
+        Png,
+        Qoi,   // lossless and single pass, encodes at close to memory speed
+        Pnm    // uncompressed netpbm: PGM, PPM or PAM depending on comp
+    };
+
+    // From the file extension: .png, .qoi, .pgm/.ppm/.pam/.pnm, anything else is JPEG
+    ImageFormat image_format_from_filename(const std::string &filename);
+
+    // QOI (qoiformat.org), grey inputs are expanded to RGB(A)
+    int write_qoi(const char *filename, int width, int height, int comp, const void *data);
+    int write_qoi_to_func(stbi_write_func *func, void *context, int width, int height, int comp, const void *data);
+    // Raw pixels behind a netpbm header, for intermediate frames that only need to be read back
+    int write_pnm(const char *filename, int width, int height, int comp, const void *data);
+    int write_pnm_to_func(stbi_write_func *func, void *context, int width, int height, int comp, const void *data);
+
+    // Writes in any of the formats above, jpeg is only used for ImageFormat::Jpeg
+    int write_image(const char *filename, ImageFormat format, const JpegEncoder &jpeg, int width, int height, int comp, const void *data);
+    int write_image(const ImageSink &sink, ImageFormat format, const JpegEncoder &jpeg, int width, int height, int comp, const void *data);
+
+};
+
+#endif
@@ -1,27 +1,86 @@
 #include "geometry.h"
 #include "matrix.h"
 #include "softengine.h"
+#include "trace.h"
+
+#include <cstdlib>
+#include <unistd.h>
 
 using namespace SoftEngine;
 
-int main() {
+int main(int argc, char **argv) {
+
+    // SOFTENGINE_TRACE=trace.json records a Chrome/Perfetto timeline of the run
+    const char *traceFile = getenv("SOFTENGINE_TRACE");
+    if (traceFile != NULL) {
+        Trace::setThreadName("main");
+        Trace::start();
+    }
 
     Mesh duck = Mesh("../duck.obj", 0);
-    Mesh diablo = Mesh("../diablo3_pose.obj", 1);
-    Mesh af_head = Mesh("../african_head.obj", 1);
-    af_head.setRotation(0.f,135.6f, 0.f);
-    af_head.setTranslation(-0.85f, 0, -0.25f);
-    diablo.setRotation(0.f, 135.3f, 0.f);
-    diablo.setTranslation(0.3f, 0, -0.78f);
+    Scene scene;
+    int diablo = scene.addNode(scene.addMesh(Mesh("../diablo3_pose.obj", 1)));
+    scene.setRotation(diablo, 0.f, 135.3f, 0.f);
+    scene.setTranslation(diablo, 0.3f, 0, -0.78f);
+    int af_head = scene.addNode(scene.addMesh(Mesh("../african_head.obj", 1)));
+    scene.setRotation(af_head, 0.f,135.6f, 0.f);
+    scene.setTranslation(af_head, -0.85f, 0, -0.25f);
+    // The eyes are modelled in the space of the head, so they follow it with no transform of their own
+    scene.addNode(scene.addMesh(Mesh("../african_head_eye_inner.obj", 1)), af_head);
+    scene.addNode(scene.addMesh(Mesh("../african_head_eye_outer.obj", 1)), af_head);
+    // Distant or small instances are drawn from simplified levels, picked per frame from their size on screen.
+    // Triangles are first put in vertex cache order, which the levels keep, then every level is cut into clusters
+    // culled as a whole. Position streams let a mesh drawn mostly whole at full detail be transformed in one vector loop
+    for (Mesh &mesh : scene.meshes) {
+        mesh.optimizeVertexOrder();
+        mesh.buildLods();
+        mesh.buildClusters();
+        mesh.buildPositionStreams();
+    }
     //duck.setTranslation(0, 0, 0.50f);
     Camera camera = Camera();
     Device device(1024, 768);
-    std::vector<Mesh> meshes;
-    //meshes.push_back(duck);
-    meshes.push_back(diablo);
-    meshes.push_back(af_head);
     camera.position = Vec3f(0.f, 0.f, -2.f);
     camera.target = Vec3f(0.f, 0.f, 1.f);
-    device.render_prep(camera, meshes, 90.f);
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "--y4m" || mode == "--ppm") {
+        // "Projet --y4m [frames]" streams a turntable of raw frames to stdout, e.g. "| ffmpeg -i - out.mp4"
+        int frames = argc > 2 ? atoi(argv[2]) : 60;
+        SequenceWriter writer(STDOUT_FILENO, mode == "--y4m" ? SequenceFormat::Y4M420 : SequenceFormat::PPM,
+                              device.width, device.height);
+        for (int i = 0; i < frames; i++) {
+            float angle = 2.f * (float)M_PI * i / frames;
+            scene.setRotation(diablo, 0.f, 135.3f + angle, 0.f);
+            scene.setRotation(af_head, 0.f, 135.6f + angle, 0.f);
+            if (!device.render_frame(camera, scene, 90.f, writer)) break;
+        }
+    }
+    else if (mode == "--frames") {
+        // "Projet --frames [frames] [.jpg|.png|.qoi|.ppm]" writes a turntable as frame_0000.jpg ..., encoding in the background
+        int frames = argc > 2 ? atoi(argv[2]) : 60;
+        std::string extension = argc > 3 ? argv[3] : ".jpg";
+        AsyncImageWriter writer;
+        for (int i = 0; i < frames; i++) {
+            float angle = 2.f * (float)M_PI * i / frames;
+            scene.setRotation(diablo, 0.f, 135.3f + angle, 0.f);
+            scene.setRotation(af_head, 0.f, 135.6f + angle, 0.f);
+            char filename[64];
+            snprintf(filename, sizeof(filename), "frame_%04d%s", i, extension.c_str());
+            device.render_async(camera, scene, 90.f, writer, filename);
+        }
+        writer.flush();
+    }
+    else if (mode == "-") {
+        // "Projet -" streams out.jpg then out_3d.jpg to stdout, e.g. into a pipe, instead of writing files
+        device.render_prep(camera, scene, 90.f, ImageSink::stream(stdout), ImageSink::stream(stdout));
+        fflush(stdout);
+    }
+    else {
+        device.render_prep(camera, scene, 90.f);
+    }
+    if (traceFile != NULL) {
+        Trace::stop();
+        Trace::write(traceFile);
+    }
     return 0;
 }
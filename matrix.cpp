@@ -69,6 +69,11 @@ double& Matrix::operator()(const unsigned &rowNo, const unsigned & colNo)
     return this->m_matrix[rowNo][colNo];
 }
 
+double Matrix::operator()(const unsigned &rowNo, const unsigned & colNo) const
+{
+    return this->m_matrix[rowNo][colNo];
+}
+
 // No brainer - returns row #
 unsigned Matrix::getRows() const
 {
@@ -28,6 +28,7 @@ public:
     Matrix transpose();
 
     double& operator()(const unsigned &, const unsigned &);
+    double operator()(const unsigned &, const unsigned &) const;
     void print() const;
     unsigned getRows() const;
     unsigned getCols() const;
@@ -0,0 +1,46 @@
+#include <cmath>
+
+#include "octahedral.h"
+
+using namespace SoftEngine;
+
+static float SignNotZero(float v)
+{
+    return v < 0.0f ? -1.0f : 1.0f;
+}
+
+uint32_t SoftEngine::OctahedralEncode(Vec3f n, int bits) {
+    float sum = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    if (sum == 0.0f) return 0;
+    float x = n.x / sum, y = n.y / sum;
+    // The lower half folds over the diagonals onto the corners of the square
+    if (n.z < 0.0f) {
+        float fx = (1.0f - fabsf(y)) * SignNotZero(x);
+        float fy = (1.0f - fabsf(x)) * SignNotZero(y);
+        x = fx;
+        y = fy;
+    }
+    float scale = (float)((1 << (bits - 1)) - 1);
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t qx = (uint32_t)(int32_t) lroundf(x * scale) & mask;
+    uint32_t qy = (uint32_t)(int32_t) lroundf(y * scale) & mask;
+    return qx | qy << bits;
+}
+
+Vec3f SoftEngine::OctahedralDecode(uint32_t packed, int bits) {
+    float scale = (float)((1 << (bits - 1)) - 1);
+    uint32_t mask = (1u << bits) - 1;
+    // Sign extension of each field
+    int32_t qx = (int32_t)((packed & mask) << (32 - bits)) >> (32 - bits);
+    int32_t qy = (int32_t)(((packed >> bits) & mask) << (32 - bits)) >> (32 - bits);
+    float x = qx / scale, y = qy / scale;
+    float z = 1.0f - fabsf(x) - fabsf(y);
+    if (z < 0.0f) {
+        float fx = (1.0f - fabsf(y)) * SignNotZero(x);
+        float fy = (1.0f - fabsf(x)) * SignNotZero(y);
+        x = fx;
+        y = fy;
+    }
+    Vec3f n = Vec3f(x, y, z);
+    return n / n.norm();
+}
@@ -0,0 +1,17 @@
+#ifndef PROJET_OCTAHEDRAL_H
+#define PROJET_OCTAHEDRAL_H
+
+#include <cstdint>
+
+#include "geometry.h"
+
+namespace SoftEngine {
+
+    // Unit vector folded onto an octahedron and stored as two signed values of bits each (at most 16), x in the
+    // low bits and y above it. 8 bits keep the direction within about one degree, 16 bits within a few hundredths.
+    uint32_t OctahedralEncode(Vec3f n, int bits = 16);
+    Vec3f OctahedralDecode(uint32_t packed, int bits = 16);
+
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include <algorithm>
+#include <cstring>
+
+#include "radixsort.h"
+#include "threadpool.h"
+
+// Blocks per thread for counting and scattering, and the smallest block worth a job
+#define RADIX_BLOCKS_PER_THREAD 2
+#define RADIX_MIN_BLOCK 16384
+
+using namespace SoftEngine;
+
+uint32_t SoftEngine::FloatSortKey(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    // Negative floats order backwards, so all their bits flip; positive ones only need the sign bit set
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+void SoftEngine::RadixSort(std::vector<uint32_t> &keys, std::vector<uint32_t> &values) {
+    size_t n = keys.size();
+    if (n < 2) {
+        return;
+    }
+    ThreadPool &pool = ThreadPool::shared();
+    int blocks = (int) std::min<size_t>(pool.size() * RADIX_BLOCKS_PER_THREAD, (n + RADIX_MIN_BLOCK - 1) / RADIX_MIN_BLOCK);
+    std::vector<uint32_t> keysOut(n), valuesOut(n);
+    // Digit counts of each block, then the position where the block writes its next key with each digit
+    std::vector<size_t> offsets((size_t) blocks * 256);
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        pool.parallelFor("radix count", blocks, [&](int b) {
+            size_t *count = &offsets[(size_t) b * 256];
+            for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; i++) {
+                count[(keys[i] >> shift) & 0xff]++;
+            }
+        });
+
+        bool skip = false;
+        size_t position = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            size_t total = 0;
+            for (int b = 0; b < blocks; b++) {
+                size_t count = offsets[(size_t) b * 256 + digit];
+                offsets[(size_t) b * 256 + digit] = position + total;
+                total += count;
+            }
+            skip = skip || total == n;
+            position += total;
+        }
+        if (skip) {
+            continue;
+        }
+
+        pool.parallelFor("radix scatter", blocks, [&](int b) {
+            size_t *offset = &offsets[(size_t) b * 256];
+            for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; i++) {
+                size_t destination = offset[(keys[i] >> shift) & 0xff]++;
+                keysOut[destination] = keys[i];
+                valuesOut[destination] = values[i];
+            }
+        });
+        keys.swap(keysOut);
+        values.swap(valuesOut);
+    }
+}
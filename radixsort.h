@@ -0,0 +1,19 @@
+#ifndef PROJET_RADIXSORT_H
+#define PROJET_RADIXSORT_H
+
+#include <cstdint>
+#include <vector>
+
+namespace SoftEngine {
+
+    // Maps a float to an unsigned key with the same order, -0 sorting just before +0
+    uint32_t FloatSortKey(float value);
+
+    // Stable LSD radix sort of keys in ascending order, values are moved along with their keys.
+    // Four 8 bit passes, each counting digits per block then scattering per block on ThreadPool::shared();
+    // a pass where every key has the same digit is skipped.
+    void RadixSort(std::vector<uint32_t> &keys, std::vector<uint32_t> &values);
+
+};
+
+#endif
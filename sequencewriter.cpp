@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#include "sequencewriter.h"
+#include "threadpool.h"
+#include "trace.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define SEQUENCE_SIMD_X86
+#include <immintrin.h>
+#endif
+
+using namespace SoftEngine;
+
+// Full range BT.601 in 8 bit fixed point, each chroma row sums to 0 so that grey maps to 128
+static inline void RgbToYuv(int r, int g, int b, unsigned char *y, unsigned char *u, unsigned char *v)
+{
+    *y = (unsigned char)((77 * r + 150 * g + 29 * b + 128) >> 8);
+    *u = (unsigned char)(((-43 * r - 84 * g + 127 * b + 128) >> 8) + 128);
+    *v = (unsigned char)(((127 * r - 106 * g - 21 * b + 128) >> 8) + 128);
+}
+
+static void RgbRowToYuvScalar(const unsigned char *rgb, unsigned char *y, unsigned char *u, unsigned char *v, int count)
+{
+    for (int i = 0; i < count; i++) {
+        RgbToYuv(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2], y + i, u + i, v + i);
+    }
+}
+
+// Averages two full resolution chroma rows into one row of width (count + 1) / 2
+static void HalveRowsScalar(const unsigned char *row0, const unsigned char *row1, unsigned char *out, int count)
+{
+    for (int i = 0; i < count; i += 2) {
+        int next = std::min(i + 1, count - 1);
+        out[i / 2] = (unsigned char)((row0[i] + row0[next] + row1[i] + row1[next] + 2) >> 2);
+    }
+}
+
+#ifdef SEQUENCE_SIMD_X86
+
+// pshufb masks gathering channel c of 16 packed RGB pixels out of the k-th 16 byte load
+struct RgbShuffle {
+    __m128i masks[3][3];
+
+    RgbShuffle() {
+        for (int c = 0; c < 3; c++) {
+            for (int k = 0; k < 3; k++) {
+                alignas(16) signed char bytes[16];
+                for (int j = 0; j < 16; j++) {
+                    int src = 3 * j + c - 16 * k;
+                    bytes[j] = (signed char)(src >= 0 && src < 16 ? src : -1);
+                }
+                masks[c][k] = _mm_load_si128((const __m128i *) bytes);
+            }
+        }
+    }
+};
+
+__attribute__((target("ssse3"))) static inline __m128i GatherChannel(const RgbShuffle &shuffle, int c, __m128i a0, __m128i a1, __m128i a2)
+{
+    return _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, shuffle.masks[c][0]), _mm_shuffle_epi8(a1, shuffle.masks[c][1])),
+                        _mm_shuffle_epi8(a2, shuffle.masks[c][2]));
+}
+
+// Same arithmetic as RgbToYuv on eight 16 bit lanes, the wrap-around of intermediate sums cancels out
+__attribute__((target("ssse3"))) static inline __m128i Weighted(__m128i r, __m128i g, __m128i b, short cr, short cg, short cb)
+{
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(cb)), _mm_set1_epi16(128));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(r, _mm_set1_epi16(cr)));
+    return _mm_add_epi16(sum, _mm_mullo_epi16(g, _mm_set1_epi16(cg)));
+}
+
+__attribute__((target("ssse3"))) static void RgbRowToYuvSsse3(const unsigned char *rgb, unsigned char *y, unsigned char *u, unsigned char *v, int count)
+{
+    static const RgbShuffle shuffle;
+    const __m128i zero = _mm_setzero_si128(), offset = _mm_set1_epi16(128);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(rgb + i * 3));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(rgb + i * 3 + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i *)(rgb + i * 3 + 32));
+        __m128i r = GatherChannel(shuffle, 0, a0, a1, a2);
+        __m128i g = GatherChannel(shuffle, 1, a0, a1, a2);
+        __m128i b = GatherChannel(shuffle, 2, a0, a1, a2);
+        __m128i rl = _mm_unpacklo_epi8(r, zero), rh = _mm_unpackhi_epi8(r, zero);
+        __m128i gl = _mm_unpacklo_epi8(g, zero), gh = _mm_unpackhi_epi8(g, zero);
+        __m128i bl = _mm_unpacklo_epi8(b, zero), bh = _mm_unpackhi_epi8(b, zero);
+
+        __m128i yl = _mm_srli_epi16(Weighted(rl, gl, bl, 77, 150, 29), 8);
+        __m128i yh = _mm_srli_epi16(Weighted(rh, gh, bh, 77, 150, 29), 8);
+        __m128i ul = _mm_add_epi16(_mm_srai_epi16(Weighted(rl, gl, bl, -43, -84, 127), 8), offset);
+        __m128i uh = _mm_add_epi16(_mm_srai_epi16(Weighted(rh, gh, bh, -43, -84, 127), 8), offset);
+        __m128i vl = _mm_add_epi16(_mm_srai_epi16(Weighted(rl, gl, bl, 127, -106, -21), 8), offset);
+        __m128i vh = _mm_add_epi16(_mm_srai_epi16(Weighted(rh, gh, bh, 127, -106, -21), 8), offset);
+        _mm_storeu_si128((__m128i *)(y + i), _mm_packus_epi16(yl, yh));
+        _mm_storeu_si128((__m128i *)(u + i), _mm_packus_epi16(ul, uh));
+        _mm_storeu_si128((__m128i *)(v + i), _mm_packus_epi16(vl, vh));
+    }
+    RgbRowToYuvScalar(rgb + i * 3, y + i, u + i, v + i, count - i);
+}
+
+__attribute__((target("ssse3"))) static void HalveRowsSsse3(const unsigned char *row0, const unsigned char *row1, unsigned char *out, int count)
+{
+    const __m128i ones = _mm_set1_epi8(1), two = _mm_set1_epi16(2);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i s0 = _mm_maddubs_epi16(_mm_loadu_si128((const __m128i *)(row0 + i)), ones);
+        __m128i s1 = _mm_maddubs_epi16(_mm_loadu_si128((const __m128i *)(row1 + i)), ones);
+        __m128i avg = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(s0, s1), two), 2);
+        _mm_storel_epi64((__m128i *)(out + i / 2), _mm_packus_epi16(avg, avg));
+    }
+    HalveRowsScalar(row0 + i, row1 + i, out + i / 2, count - i);
+}
+
+#endif
+
+typedef void (*RgbRowToYuvFunc)(const unsigned char *rgb, unsigned char *y, unsigned char *u, unsigned char *v, int count);
+typedef void (*HalveRowsFunc)(const unsigned char *row0, const unsigned char *row1, unsigned char *out, int count);
+
+static bool HasSsse3()
+{
+#ifdef SEQUENCE_SIMD_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#else
+    return false;
+#endif
+}
+
+static RgbRowToYuvFunc SelectRgbRowToYuv()
+{
+#ifdef SEQUENCE_SIMD_X86
+    if (HasSsse3()) return RgbRowToYuvSsse3;
+#endif
+    return RgbRowToYuvScalar;
+}
+
+static HalveRowsFunc SelectHalveRows()
+{
+#ifdef SEQUENCE_SIMD_X86
+    if (HasSsse3()) return HalveRowsSsse3;
+#endif
+    return HalveRowsScalar;
+}
+
+SequenceWriter::SequenceWriter(int fd, SequenceFormat format, int width, int height, int fps) {
+    this->fd = fd;
+    this->format = format;
+    this->width = width;
+    this->height = height;
+    this->fps = fps;
+    frames = 0;
+}
+
+int SequenceWriter::getFrameCount() const {
+    return frames;
+}
+
+bool SequenceWriter::writeAll(const void *data, size_t size) {
+    const char *bytes = (const char *) data;
+    while (size > 0) {
+        ssize_t written = ::write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            std::fprintf(stderr, "Failed to write frame %d: %s\n", frames, strerror(errno));
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Y, U and V planes laid out one after the other in frame, after the FRAME marker
+void SequenceWriter::convertYuv(const unsigned char *rgb) {
+    static const RgbRowToYuvFunc rowToYuv = SelectRgbRowToYuv();
+    static const HalveRowsFunc halveRows = SelectHalveRows();
+    static const char marker[] = "FRAME\n";
+    const size_t markerSize = sizeof(marker) - 1;
+
+    bool subsample = format == SequenceFormat::Y4M420;
+    int chromaWidth = subsample ? (width + 1) / 2 : width;
+    int chromaHeight = subsample ? (height + 1) / 2 : height;
+    size_t lumaSize = (size_t) width * height;
+    size_t chromaSize = (size_t) chromaWidth * chromaHeight;
+    frame.resize(markerSize + lumaSize + 2 * chromaSize);
+    memcpy(frame.data(), marker, markerSize);
+    unsigned char *planeY = frame.data() + markerSize;
+    unsigned char *planeU = planeY + lumaSize;
+    unsigned char *planeV = planeU + chromaSize;
+
+    // Bands of whole chroma rows, so a 4:2:0 row pair never straddles two jobs
+    ThreadPool &pool = ThreadPool::shared();
+    int bands = std::min(chromaHeight, pool.size() * 4);
+    pool.parallelFor("yuv convert", bands, [&](int band) {
+        int c0 = (int)((long long) chromaHeight * band / bands);
+        int c1 = (int)((long long) chromaHeight * (band + 1) / bands);
+        if (!subsample) {
+            for (int y = c0; y < c1; y++) {
+                rowToYuv(rgb + (size_t) y * width * 3, planeY + (size_t) y * width,
+                         planeU + (size_t) y * width, planeV + (size_t) y * width, width);
+            }
+            return;
+        }
+        std::vector<unsigned char> fullU(width * 2), fullV(width * 2);
+        for (int cy = c0; cy < c1; cy++) {
+            int y0 = cy * 2;
+            int y1 = std::min(y0 + 1, height - 1);
+            rowToYuv(rgb + (size_t) y0 * width * 3, planeY + (size_t) y0 * width, fullU.data(), fullV.data(), width);
+            if (y1 != y0) {
+                rowToYuv(rgb + (size_t) y1 * width * 3, planeY + (size_t) y1 * width, fullU.data() + width, fullV.data() + width, width);
+            }
+            else {
+                memcpy(fullU.data() + width, fullU.data(), width);
+                memcpy(fullV.data() + width, fullV.data(), width);
+            }
+            halveRows(fullU.data(), fullU.data() + width, planeU + (size_t) cy * chromaWidth, width);
+            halveRows(fullV.data(), fullV.data() + width, planeV + (size_t) cy * chromaWidth, width);
+        }
+    });
+}
+
+bool SequenceWriter::writeFrame(const unsigned char *rgb) {
+    TraceScope traceFrame("sequence frame", "output", frames);
+    char header[128];
+    if (format == SequenceFormat::PPM) {
+        int length = std::snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+        if (!writeAll(header, length) || !writeAll(rgb, (size_t) width * height * 3)) return false;
+    }
+    else {
+        if (frames == 0) {
+            int length = std::snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 %s XCOLORRANGE=FULL\n",
+                                       width, height, fps, format == SequenceFormat::Y4M420 ? "C420jpeg" : "C444");
+            if (!writeAll(header, length)) return false;
+        }
+        convertYuv(rgb);
+        if (!writeAll(frame.data(), frame.size())) return false;
+    }
+    frames++;
+    return true;
+}
@@ -0,0 +1,42 @@
+#ifndef PROJET_SEQUENCEWRITER_H
+#define PROJET_SEQUENCEWRITER_H
+
+#include <cstddef>
+#include <vector>
+
+namespace SoftEngine {
+
+    enum class SequenceFormat {
+        Y4M444,   // YUV4MPEG2, full resolution chroma
+        Y4M420,   // YUV4MPEG2, chroma averaged over 2x2 pixels
+        PPM       // binary PPM (P6) frames back to back
+    };
+
+    // Writes successive RGB8 frames as an uncompressed stream on a file descriptor (a file, a pipe
+    // into ffmpeg, stdout...), skipping the lossy encode and the decode of a JPEG sequence.
+    // Y4M uses full range BT.601 like JPEG, ffmpeg reads it as "-f yuv4mpegpipe".
+    class SequenceWriter {
+
+    public:
+        SequenceWriter(int fd, SequenceFormat format, int width, int height, int fps = 25);
+
+        // rgb holds width * height * 3 bytes; returns false once the descriptor stops accepting data
+        bool writeFrame(const unsigned char *rgb);
+        int getFrameCount() const;
+
+    private:
+        int fd;
+        SequenceFormat format;
+        int width;
+        int height;
+        int fps;
+        int frames;
+        std::vector<unsigned char> frame;
+
+        bool writeAll(const void *data, size_t size);
+        void convertYuv(const unsigned char *rgb);
+    };
+
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <utility>
+
+#include "simplify.h"
+
+// Weight of the planes keeping open borders in place, relative to the face planes
+#define SIMPLIFY_BORDER_WEIGHT 10.0
+
+using namespace SoftEngine;
+
+// Symmetric 4x4 matrix summing squared distances to planes, upper triangle stored row by row
+struct Quadric {
+    double q[10];
+
+    Quadric() {
+        std::fill(q, q + 10, 0.0);
+    }
+
+    void addPlane(double a, double b, double c, double d, double weight) {
+        q[0] += weight * a * a; q[1] += weight * a * b; q[2] += weight * a * c; q[3] += weight * a * d;
+        q[4] += weight * b * b; q[5] += weight * b * c; q[6] += weight * b * d;
+        q[7] += weight * c * c; q[8] += weight * c * d;
+        q[9] += weight * d * d;
+    }
+
+    Quadric &operator+=(const Quadric &other) {
+        for (int i = 0; i < 10; i++) q[i] += other.q[i];
+        return *this;
+    }
+
+    double error(const Vec3f &v) const {
+        double x = v.x, y = v.y, z = v.z;
+        return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+             + q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+             + q[7] * z * z + 2 * q[8] * z
+             + q[9];
+    }
+};
+
+// Moving vertex from onto vertex to, with the stamps both vertices had when the cost was computed
+struct Collapse {
+    double cost;
+    int from;
+    int to;
+    unsigned int fromStamp;
+    unsigned int toStamp;
+
+    bool operator>(const Collapse &other) const {
+        return cost > other.cost;
+    }
+};
+
+static Vec3f Cross(const Vec3f &a, const Vec3f &b)
+{
+    return Vec3f(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+std::vector<int> SoftEngine::SimplifyIndices(const std::vector<Vec3f> &verts, const std::vector<int> &indices, size_t targetTriangles) {
+    size_t triangleCount = indices.size() / 3;
+    std::vector<int> corners(indices.begin(), indices.begin() + triangleCount * 3);
+    std::vector<char> removed(triangleCount, 0);
+    std::vector<Quadric> quadrics(verts.size());
+    std::vector<std::vector<int> > vertexTriangles(verts.size());
+    std::vector<unsigned int> stamps(verts.size(), 0);
+    std::vector<char> alive(verts.size(), 1);
+
+    // Face planes weighted by area, and the number of faces along each edge to find the borders
+    std::map<std::pair<int, int>, int> edgeFaces;
+    for (size_t t = 0; t < triangleCount; t++) {
+        const int *c = &corners[t * 3];
+        Vec3f n = Cross(verts[c[1]] - verts[c[0]], verts[c[2]] - verts[c[0]]);
+        double length = n.norm();
+        for (int k = 0; k < 3; k++) {
+            vertexTriangles[c[k]].push_back((int) t);
+            int a = c[k], b = c[(k + 1) % 3];
+            edgeFaces[std::make_pair(std::min(a, b), std::max(a, b))]++;
+        }
+        if (length > 0) {
+            double a = n.x / length, b = n.y / length, cc = n.z / length;
+            double d = -(a * verts[c[0]].x + b * verts[c[0]].y + cc * verts[c[0]].z);
+            for (int k = 0; k < 3; k++) {
+                quadrics[c[k]].addPlane(a, b, cc, d, length * 0.5);
+            }
+        }
+    }
+    for (size_t t = 0; t < triangleCount; t++) {
+        const int *c = &corners[t * 3];
+        Vec3f n = Cross(verts[c[1]] - verts[c[0]], verts[c[2]] - verts[c[0]]);
+        for (int k = 0; k < 3; k++) {
+            int a = c[k], b = c[(k + 1) % 3];
+            if (edgeFaces[std::make_pair(std::min(a, b), std::max(a, b))] != 1) continue;
+            // Plane through the border edge, perpendicular to its face
+            Vec3f edge = verts[b] - verts[a];
+            Vec3f p = Cross(edge, n);
+            double length = p.norm();
+            if (length == 0) continue;
+            double pa = p.x / length, pb = p.y / length, pc = p.z / length;
+            double d = -(pa * verts[a].x + pb * verts[a].y + pc * verts[a].z);
+            double weight = SIMPLIFY_BORDER_WEIGHT * (edge * edge);
+            quadrics[a].addPlane(pa, pb, pc, d, weight);
+            quadrics[b].addPlane(pa, pb, pc, d, weight);
+        }
+    }
+
+    std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse> > heap;
+    auto pushEdge = [&](int u, int v) {
+        Quadric sum = quadrics[u];
+        sum += quadrics[v];
+        double intoV = sum.error(verts[v]);
+        double intoU = sum.error(verts[u]);
+        if (intoV <= intoU) {
+            heap.push(Collapse{ intoV, u, v, stamps[u], stamps[v] });
+        }
+        else {
+            heap.push(Collapse{ intoU, v, u, stamps[v], stamps[u] });
+        }
+    };
+    for (auto &edge : edgeFaces) {
+        pushEdge(edge.first.first, edge.first.second);
+    }
+    edgeFaces.clear();
+
+    size_t live = triangleCount;
+    while (live > targetTriangles && !heap.empty()) {
+        Collapse collapse = heap.top();
+        heap.pop();
+        int from = collapse.from, to = collapse.to;
+        if (!alive[from] || !alive[to] || stamps[from] != collapse.fromStamp || stamps[to] != collapse.toStamp) continue;
+
+        // Triangles keeping both corners must not turn over once from sits on to
+        bool flips = false;
+        for (int t : vertexTriangles[from]) {
+            if (removed[t]) continue;
+            int *c = &corners[t * 3];
+            if (c[0] == to || c[1] == to || c[2] == to) continue;
+            Vec3f before = Cross(verts[c[1]] - verts[c[0]], verts[c[2]] - verts[c[0]]);
+            Vec3f p[3];
+            for (int k = 0; k < 3; k++) p[k] = verts[c[k] == from ? to : c[k]];
+            Vec3f after = Cross(p[1] - p[0], p[2] - p[0]);
+            if (before * after <= 0) {
+                flips = true;
+                break;
+            }
+        }
+        if (flips) continue;
+
+        for (int t : vertexTriangles[from]) {
+            if (removed[t]) continue;
+            int *c = &corners[t * 3];
+            if (c[0] == to || c[1] == to || c[2] == to) {
+                removed[t] = 1;
+                live--;
+                continue;
+            }
+            for (int k = 0; k < 3; k++) {
+                if (c[k] == from) c[k] = to;
+            }
+            vertexTriangles[to].push_back(t);
+        }
+        quadrics[to] += quadrics[from];
+        alive[from] = 0;
+        vertexTriangles[from].clear();
+        stamps[to]++;
+
+        // Drop the triangles removed so far from the list of to, then queue its edges again with the new quadric
+        std::vector<int> &around = vertexTriangles[to];
+        around.erase(std::remove_if(around.begin(), around.end(), [&](int t) { return removed[t] != 0; }), around.end());
+        for (int t : around) {
+            for (int k = 0; k < 3; k++) {
+                int w = corners[t * 3 + k];
+                if (w != to) pushEdge(to, w);
+            }
+        }
+    }
+
+    std::vector<int> result;
+    result.reserve(live * 3);
+    for (size_t t = 0; t < triangleCount; t++) {
+        if (!removed[t]) {
+            result.insert(result.end(), corners.begin() + t * 3, corners.begin() + t * 3 + 3);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,19 @@
+#ifndef PROJET_SIMPLIFY_H
+#define PROJET_SIMPLIFY_H
+
+#include <cstddef>
+#include <vector>
+
+#include "geometry.h"
+
+namespace SoftEngine {
+
+    // Quadric error simplification (Garland and Heckbert) of a triangle list indexing verts, down to about
+    // targetTriangles. Edges are collapsed into whichever endpoint has the lower error, so the result indexes the
+    // same verts and levels of detail can share one vertex array. Open borders are held in place by extra planes
+    // along them, and a collapse that would flip a triangle is skipped.
+    std::vector<int> SimplifyIndices(const std::vector<Vec3f> &verts, const std::vector<int> &indices, size_t targetTriangles);
+
+};
+
+#endif
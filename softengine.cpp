@@ -3,23 +3,56 @@
 #include <iterator>
 #include <cstring>
 #include <algorithm>
+#include <type_traits>
+#include <cfloat>
 
 #include "softengine.h"
 #include "matrix.h"
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#include "imagewriter.h"
+#include "octahedral.h"
+#include "radixsort.h"
+#include "simplify.h"
+#include "trace.h"
+#include "vertexcache.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define SOFTENGINE_SIMD_X86
+#include <immintrin.h>
+#endif
 
 #define CAMERA_DISTANCE -0.04f
+// Cost of a candidate triangle's normal facing away from its cluster's, against one new vertex
+#define CLUSTER_CONE_WEIGHT 4.0f
+// Share of a full detail mesh's indices in visible clusters above which all its vertices are transformed in one
+// vector loop rather than each on first use
+#define STREAM_MIN_VISIBLE 0.5f
 
 using namespace SoftEngine;
 
-Device::Device(int width, int height) {
+Device::Device(int width, int height, ColorFormat format, ColorLayout layout) : projectionMatrix(4, 4, 0) {
     this->width = width;
     this->height = height;
-    framebuffer = std::vector<Vec3f>(width * height);
-    for (int i = 0 ; i < width * height ; i++) {
-        framebuffer[i] = Vec3f(0, 0, 0);
+    framebuffer = ColorBuffer(width, height, format, layout);
+    framebuffer.clear(Vec3f(0, 0, 0));
+    jpegEncoder = JpegEncoder(100, ChromaSubsampling::Yuv444);
+    projectionFov = NAN;
+    lodPixelsPerTriangle = 4.0f;
+}
+
+void Device::clear(Vec3f color) {
+    framebuffer.clear(color);
+}
+
+// Converts the framebuffer to 8 bit RGB
+void Device::resolve(std::vector<unsigned char> &pixmap) {
+    pixmap.resize(width*height*3);
+    framebuffer.resolve(pixmap.data());
+}
+
+// The quantization tables are only rebuilt when the options actually change
+void Device::setJpegOptions(int quality, ChromaSubsampling subsampling) {
+    if (quality != jpegEncoder.getQuality() || subsampling != jpegEncoder.getSubsampling()) {
+        jpegEncoder = JpegEncoder(quality, subsampling);
     }
 }
 
@@ -31,15 +64,19 @@ Triangle::Triangle(Vec3f v1, Vec3f v2, Vec3f v3) {
 
 Triangle::Triangle() {}
 
-Mesh::Mesh() {
+Mesh::Mesh() : worldMatrix(4, 4, 0) {
+    worldDirty = true;
+    boundsRadius = 0.0f;
     rotX = 0.0f;
+    rotY = 0.0f;
     rotZ = 0.0f;
     translationX = 0.0f;
     translationY = 0.0f;
     translationZ = 0.0f;
 }
 
-Mesh::Mesh(const char *filename, int method) {
+Mesh::Mesh(const char *filename, int method) : worldMatrix(4, 4, 0) {
+    worldDirty = true;
     if (method == 0) {
         std::ifstream in;
         in.open (filename, std::ifstream::in);
@@ -69,6 +106,9 @@ Mesh::Mesh(const char *filename, int method) {
             }
         }
         for (Vec3i face: faces_n) {
+            indices.push_back(face.x);
+            indices.push_back(face.y);
+            indices.push_back(face.z);
             Triangle t = Triangle();
             t.vertices[0] = verts.at(face.x);
             t.vertices[1] = verts.at(face.y);
@@ -134,9 +174,15 @@ Mesh::Mesh(const char *filename, int method) {
             t.vertices[1] = verts.at(p2.x);
             t.vertices[2] = verts.at(p3.x);
             polygons.push_back(t);
+            indices.push_back(p1.x);
+            indices.push_back(p2.x);
+            indices.push_back(p3.x);
         }
     }
+    computeBounds();
+    computeFacePlanes();
     rotX = 0.0f;
+    rotY = 0.0f;
     rotZ = 0.0f;
     translationX = 0.0f;
     translationY = 0.0f;
@@ -147,17 +193,167 @@ void Mesh::setRotation(float rotationX, float rotationY, float rotationZ) {
     rotX = rotationX;
     rotY = rotationY;
     rotZ = rotationZ;
+    worldDirty = true;
 }
 
 void Mesh::setTranslation(float trX, float trY, float trZ) {
     translationX = trX;
     translationY = trY;
     translationZ = trZ;
+    worldDirty = true;
+}
+
+const int Mesh::STREAM_WIDTH;
+
+void Mesh::buildPositionStreams() {
+    // Quantized positions are transformed one by one with the dequantization folded into the matrix
+    if (isQuantized()) return;
+    size_t padded = (verts.size() + STREAM_WIDTH - 1) / STREAM_WIDTH * STREAM_WIDTH;
+    positionX.resize(padded);
+    positionY.resize(padded);
+    positionZ.resize(padded);
+    for (size_t v = 0; v < padded; v++) {
+        const Vec3f &p = verts[std::min(v, verts.size() - 1)];
+        positionX[v] = p.x;
+        positionY[v] = p.y;
+        positionZ[v] = p.z;
+    }
+}
+
+// Centered on the bounding box, large enough for the farthest vertex
+void Mesh::computeBounds() {
+    if (verts.empty()) {
+        boundsCenter = Vec3f(0, 0, 0);
+        boundsRadius = 0.0f;
+        return;
+    }
+    Vec3f lo = verts[0], hi = verts[0];
+    for (const Vec3f &v : verts) {
+        lo = Vec3f(std::min(lo.x, v.x), std::min(lo.y, v.y), std::min(lo.z, v.z));
+        hi = Vec3f(std::max(hi.x, v.x), std::max(hi.y, v.y), std::max(hi.z, v.z));
+    }
+    boundsCenter = (lo + hi) * 0.5f;
+    float radius2 = 0.0f;
+    for (const Vec3f &v : verts) {
+        Vec3f d = v - boundsCenter;
+        radius2 = std::max(radius2, d * d);
+    }
+    boundsRadius = sqrtf(radius2);
 }
 
-Vec3f MultiplyMatrixVector(Vec3f v, Matrix m)
+// indices and the triangle lists kept next to it, one entry per triangle, are put in order
+void Mesh::reorderTriangles(const std::vector<int> &order) {
+    size_t triangleCount = indices.size() / 3;
+    std::vector<int> sorted(order.size() * 3);
+    for (size_t t = 0; t < order.size(); t++) {
+        std::copy(indices.begin() + order[t] * 3, indices.begin() + order[t] * 3 + 3, sorted.begin() + t * 3);
+    }
+    indices.swap(sorted);
+    auto reorder = [&](auto &list) {
+        if (list.size() != triangleCount) return;
+        typename std::remove_reference<decltype(list)>::type copy;
+        copy.reserve(triangleCount);
+        for (int t : order) copy.push_back(list[t]);
+        list.swap(copy);
+    };
+    reorder(polygons);
+    reorder(faces);
+    reorder(faces_n);
+    reorder(faceNormals);
+    reorder(faceDistances);
+}
+
+void Mesh::optimizeVertexOrder(int cacheSize) {
+    TraceScope traceOptimize("optimize vertex order", "stage");
+    reorderTriangles(VertexCacheOrder(indices, verts.size(), cacheSize));
+
+    std::vector<int> remap = VertexFetchRemap(indices, verts.size());
+    std::vector<Vec3f> moved(verts.size());
+    for (size_t v = 0; v < verts.size(); v++) moved[remap[v]] = verts[v];
+    verts.swap(moved);
+    for (int &index : indices) index = remap[index];
+    for (std::vector<Vec3i> &face : faces) {
+        for (Vec3i &corner : face) corner.x = remap[corner.x];
+    }
+    for (Vec3i &face : faces_n) {
+        face = Vec3i(remap[face.x], remap[face.y], remap[face.z]);
+    }
+    for (Lod &lod : lods) {
+        for (int &index : lod.indices) index = remap[index];
+    }
+    if (!positionX.empty()) buildPositionStreams();
+}
+
+static void ComputeFacePlanes(const std::vector<Vec3f> &verts, const std::vector<int> &indices,
+                              std::vector<uint32_t> &normals, std::vector<float> &distances)
+{
+    normals.resize(indices.size() / 3);
+    distances.resize(indices.size() / 3);
+    for (size_t t = 0; t < normals.size(); t++) {
+        Vec3f p0 = verts[indices[t * 3]];
+        Vec3f line1 = verts[indices[t * 3 + 1]] - p0;
+        Vec3f line2 = verts[indices[t * 3 + 2]] - p0;
+        Vec3f normal = cross(line1, line2);
+        float length = normal.norm();
+        if (length == 0.0f) {
+            // A degenerate triangle gets a plane the camera is never in front of
+            normals[t] = 0;
+            distances[t] = FLT_MAX;
+            continue;
+        }
+        // The distance comes from the decoded normal so the plane test sees the same plane as the shading
+        normals[t] = OctahedralEncode(normal / length);
+        distances[t] = OctahedralDecode(normals[t]) * p0;
+    }
+}
+
+void Mesh::computeFacePlanes() {
+    ComputeFacePlanes(verts, indices, faceNormals, faceDistances);
+    for (Lod &lod : lods) {
+        ComputeFacePlanes(verts, lod.indices, lod.faceNormals, lod.faceDistances);
+    }
+}
+
+// Each level is simplified from the one before, and the chain stops once simplification no longer gets far
+void Mesh::buildLods(int levels, float ratio) {
+    TraceScope traceLods("build lods", "stage");
+    lods.clear();
+    const std::vector<int> *previous = &indices;
+    for (int level = 0; level < levels; level++) {
+        size_t count = previous->size() / 3;
+        size_t target = (size_t)(count * ratio);
+        if (target < 8) break;
+        Lod lod;
+        lod.indices = SimplifyIndices(verts, *previous, target);
+        if (lod.indices.size() / 3 > count - (count - target) / 2) break;
+        lods.push_back(std::move(lod));
+        previous = &lods.back().indices;
+    }
+    computeFacePlanes();
+}
+
+int Mesh::getLodCount() const {
+    return (int) lods.size() + 1;
+}
+
+size_t Mesh::getTriangleCount(int level) const {
+    return level == 0 ? indices.size() / 3 : lods[level - 1].indices.size() / 3;
+}
+
+// Point v (w = 1) through an affine m, whose last column is (0, 0, 0, 1)
+Vec3f MultiplyMatrixVector(Vec3f v, const Matrix &m)
 {
     Vec3f out = Vec3f();
+    out.x = v.x * m(0,0) + v.y * m(1,0) + v.z * m(2,0) + m(3,0);
+    out.y = v.x * m(0,1) + v.y * m(1,1) + v.z * m(2,1) + m(3,1);
+    out.z = v.x * m(0,2) + v.y * m(1,2) + v.z * m(2,2) + m(3,2);
+    return out;
+}
+
+// Homogeneous v through any m, such as a projection
+Vec4f MultiplyMatrixVector(Vec4f v, const Matrix &m)
+{
+    Vec4f out = Vec4f();
     out.x = v.x * m(0,0) + v.y * m(1,0) + v.z * m(2,0) + v.w * m(3,0);
     out.y = v.x * m(0,1) + v.y * m(1,1) + v.z * m(2,1) + v.w * m(3,1);
     out.z = v.x * m(0,2) + v.y * m(1,2) + v.z * m(2,2) + v.w * m(3,2);
@@ -165,6 +361,16 @@ Vec3f MultiplyMatrixVector(Vec3f v, Matrix m)
     return out;
 }
 
+// Direction through the rotation part of m only
+Vec3f RotateVector(Vec3f v, const Matrix &m)
+{
+    Vec3f out = Vec3f();
+    out.x = v.x * m(0,0) + v.y * m(1,0) + v.z * m(2,0);
+    out.y = v.x * m(0,1) + v.y * m(1,1) + v.z * m(2,1);
+    out.z = v.x * m(0,2) + v.y * m(1,2) + v.z * m(2,2);
+    return out;
+}
+
 Matrix Matrix_MakeIdentity()
 {
     Matrix matrix = Matrix(4,4,0);
@@ -220,7 +426,7 @@ Matrix Matrix_MakeTranslation(float x, float y, float z)
     return matrix;
 }
 
-Matrix Matrix_Inverse(Matrix &m)
+Matrix Matrix_Inverse(const Matrix &m)
 {
     Matrix matrix = Matrix(4,4,0);
     matrix(0,0) = m(0,0); matrix(0,1) = m(1,0); matrix(0,2) = m(2,0); matrix(0,3) = 0.0f;
@@ -273,14 +479,402 @@ Matrix Matrix_PointAt(Vec3f &pos, Vec3f &target, Vec3f &up)
 
 }
 
+Camera::Camera() : viewMatrix(4, 4, 0) {
+    viewValid = false;
+}
+
+const Matrix &Camera::getViewMatrix() const {
+    bool moved = position.x != viewPosition.x || position.y != viewPosition.y || position.z != viewPosition.z ||
+                 target.x != viewTarget.x || target.y != viewTarget.y || target.z != viewTarget.z;
+    if (!viewValid || moved) {
+        Vec3f vUp = Vec3f(0.f, 1.f, 0.f);
+        Vec3f vPosition = position;
+        Vec3f vTarget = position + target;
+        Matrix matCamera = Matrix_PointAt(vPosition, vTarget, vUp);
+        viewMatrix = Matrix_Inverse(matCamera);
+        viewPosition = position;
+        viewTarget = target;
+        viewValid = true;
+    }
+    return viewMatrix;
+}
+
+// Rotations about Z, Y then X, followed by the translation
+Matrix Matrix_MakeTransform(float rotX, float rotY, float rotZ, float trX, float trY, float trZ)
+{
+    Matrix matRotZ = Matrix_MakeRotationZ(rotZ), matRotX = Matrix_MakeRotationX(rotX), matTran = Matrix_MakeTranslation(trX, trY, trZ);
+    Matrix matRotY = Matrix_MakeRotationY(rotY);
+    Matrix matrix = matRotZ * matRotY * matRotX;
+    return matrix * matTran;
+}
+
+// Bounding sphere and normal cone of the triangles in indices[first, end)
+static Mesh::Cluster MakeCluster(const std::vector<Vec3f> &verts, const std::vector<int> &indices, size_t first, size_t end)
+{
+    Mesh::Cluster cluster;
+    cluster.firstIndex = (int) first;
+    cluster.indexCount = (int)(end - first);
+
+    Vec3f lo = verts[indices[first]], hi = lo;
+    for (size_t j = first; j < end; j++) {
+        const Vec3f &v = verts[indices[j]];
+        lo = Vec3f(std::min(lo.x, v.x), std::min(lo.y, v.y), std::min(lo.z, v.z));
+        hi = Vec3f(std::max(hi.x, v.x), std::max(hi.y, v.y), std::max(hi.z, v.z));
+    }
+    cluster.center = (lo + hi) * 0.5f;
+    float radius2 = 0.0f;
+    for (size_t j = first; j < end; j++) {
+        Vec3f d = verts[indices[j]] - cluster.center;
+        radius2 = std::max(radius2, d * d);
+    }
+    cluster.radius = sqrtf(radius2);
+
+    // The axis is the mean face normal, the half angle reaches the normal farthest from it
+    std::vector<Vec3f> normals;
+    Vec3f axis = Vec3f(0, 0, 0);
+    for (size_t j = first; j + 2 < end; j += 3) {
+        Vec3f line1 = verts[indices[j + 1]] - verts[indices[j]];
+        Vec3f line2 = verts[indices[j + 2]] - verts[indices[j]];
+        Vec3f normal = Vector_CrossProduct(line1, line2);
+        float length = Vector_Length(normal);
+        if (length == 0.0f) continue;
+        normals.push_back(Vector_Div(normal, length));
+        axis = axis + normals.back();
+    }
+    float axisLength = Vector_Length(axis);
+    cluster.coneAxis = Vec3f(0, 0, 0);
+    cluster.coneCos = -1.0f;
+    cluster.coneSin = 0.0f;
+    if (axisLength > 0.0f) {
+        cluster.coneAxis = Vector_Div(axis, axisLength);
+        float minDot = 1.0f;
+        for (const Vec3f &normal : normals) {
+            minDot = std::min(minDot, normal * cluster.coneAxis);
+        }
+        cluster.coneCos = minDot;
+        cluster.coneSin = sqrtf(std::max(0.0f, 1.0f - minDot * minDot));
+    }
+    return cluster;
+}
+
+// Clusters are grown from the first free triangle in index order, each step adding the free triangle touching the
+// cluster that brings the fewest new vertices and whose normal is closest to the cluster's mean, so the normal cones
+// stay narrow. Returns the triangles in cluster order and the index where each cluster starts.
+static std::vector<int> GrowClusters(const std::vector<Vec3f> &verts, const std::vector<int> &indices,
+                                     int maxTriangles, int maxVertices, std::vector<int> &clusterStarts)
+{
+    size_t triangleCount = indices.size() / 3;
+    std::vector<size_t> firstTriangle(verts.size() + 1, 0);
+    for (size_t i = 0; i < triangleCount * 3; i++) firstTriangle[indices[i] + 1]++;
+    for (size_t v = 0; v < verts.size(); v++) firstTriangle[v + 1] += firstTriangle[v];
+    std::vector<int> adjacency(triangleCount * 3);
+    std::vector<size_t> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+    for (size_t i = 0; i < triangleCount * 3; i++) adjacency[fill[indices[i]]++] = (int)(i / 3);
+
+    std::vector<Vec3f> normals(triangleCount);
+    for (size_t t = 0; t < triangleCount; t++) {
+        Vec3f line1 = verts[indices[t * 3 + 1]] - verts[indices[t * 3]];
+        Vec3f line2 = verts[indices[t * 3 + 2]] - verts[indices[t * 3]];
+        Vec3f normal = Vector_CrossProduct(line1, line2);
+        float length = Vector_Length(normal);
+        normals[t] = length > 0.0f ? Vector_Div(normal, length) : Vec3f(0, 0, 0);
+    }
+
+    std::vector<int> order;
+    order.reserve(triangleCount);
+    std::vector<char> assigned(triangleCount, 0);
+    // Last cluster each vertex, or each triangle as a candidate, was added to
+    std::vector<int> vertexCluster(verts.size(), -1);
+    std::vector<int> candidateCluster(triangleCount, -1);
+    std::vector<int> candidates;
+    size_t cursor = 0;
+    int cluster = 0;
+    auto newVertices = [&](int t) {
+        int count = 0;
+        for (int k = 0; k < 3; k++) {
+            int v = indices[t * 3 + k];
+            bool repeated = (k > 0 && v == indices[t * 3]) || (k > 1 && v == indices[t * 3 + 1]);
+            if (vertexCluster[v] != cluster && !repeated) count++;
+        }
+        return count;
+    };
+    while (order.size() < triangleCount) {
+        while (assigned[cursor]) cursor++;
+        clusterStarts.push_back((int) order.size() * 3);
+        candidates.clear();
+        Vec3f axis = Vec3f(0, 0, 0);
+        int triangles = 0, vertices = 0;
+        int next = (int) cursor;
+        while (next >= 0) {
+            assigned[next] = 1;
+            order.push_back(next);
+            vertices += newVertices(next);
+            triangles++;
+            axis = axis + normals[next];
+            for (int k = 0; k < 3; k++) {
+                int v = indices[next * 3 + k];
+                if (vertexCluster[v] == cluster) continue;
+                vertexCluster[v] = cluster;
+                for (size_t a = firstTriangle[v]; a < firstTriangle[v + 1]; a++) {
+                    int t = adjacency[a];
+                    if (!assigned[t] && candidateCluster[t] != cluster) {
+                        candidateCluster[t] = cluster;
+                        candidates.push_back(t);
+                    }
+                }
+            }
+            if (triangles >= maxTriangles) break;
+
+            float axisLength = Vector_Length(axis);
+            Vec3f mean = axisLength > 0.0f ? Vector_Div(axis, axisLength) : axis;
+            next = -1;
+            float best = 0.0f;
+            for (size_t c = 0; c < candidates.size(); c++) {
+                int t = candidates[c];
+                if (assigned[t]) {
+                    candidates[c--] = candidates.back();
+                    candidates.pop_back();
+                    continue;
+                }
+                int added = newVertices(t);
+                if (vertices + added > maxVertices) continue;
+                float cost = (float) added + CLUSTER_CONE_WEIGHT * (1.0f - normals[t] * mean);
+                if (next < 0 || cost < best) {
+                    best = cost;
+                    next = t;
+                }
+            }
+        }
+        cluster++;
+    }
+    return order;
+}
+
+void Mesh::buildClusters(int maxTriangles, int maxVertices) {
+    TraceScope traceClusters("build clusters", "stage");
+    std::vector<int> starts;
+    reorderTriangles(GrowClusters(verts, indices, maxTriangles, maxVertices, starts));
+    clusters.clear();
+    for (size_t c = 0; c < starts.size(); c++) {
+        size_t end = c + 1 < starts.size() ? (size_t) starts[c + 1] : indices.size();
+        clusters.push_back(MakeCluster(verts, indices, starts[c], end));
+    }
+    for (Lod &lod : lods) {
+        starts.clear();
+        std::vector<int> order = GrowClusters(verts, lod.indices, maxTriangles, maxVertices, starts);
+        std::vector<int> sorted;
+        sorted.reserve(lod.indices.size());
+        for (int t : order) sorted.insert(sorted.end(), lod.indices.begin() + t * 3, lod.indices.begin() + t * 3 + 3);
+        lod.indices.swap(sorted);
+        ComputeFacePlanes(verts, lod.indices, lod.faceNormals, lod.faceDistances);
+        lod.clusters.clear();
+        for (size_t c = 0; c < starts.size(); c++) {
+            size_t end = c + 1 < starts.size() ? (size_t) starts[c + 1] : lod.indices.size();
+            lod.clusters.push_back(MakeCluster(verts, lod.indices, starts[c], end));
+        }
+    }
+}
+
+void Mesh::quantize(bool keepFloat) {
+    if (verts.empty() || indices.empty() || isQuantized()) return;
+    TraceScope traceQuantize("quantize", "stage");
+    Vec3f lo = verts[0], hi = verts[0];
+    for (const Vec3f &v : verts) {
+        lo = Vec3f(std::min(lo.x, v.x), std::min(lo.y, v.y), std::min(lo.z, v.z));
+        hi = Vec3f(std::max(hi.x, v.x), std::max(hi.y, v.y), std::max(hi.z, v.z));
+    }
+    quantizedOffset = lo;
+    for (int k = 0; k < 3; k++) {
+        quantizedScale[k] = hi[k] > lo[k] ? (hi[k] - lo[k]) / 65535.0f : 1.0f;
+    }
+    quantizedPositions.resize(verts.size() * 3);
+    for (size_t v = 0; v < verts.size(); v++) {
+        for (int k = 0; k < 3; k++) {
+            float q = (verts[v][k] - lo[k]) / quantizedScale[k];
+            quantizedPositions[v * 3 + k] = (uint16_t) std::max(0.0f, std::min(65535.0f, roundf(q)));
+        }
+    }
+
+    if (!uv.empty()) {
+        Vec2f uvLo = uv[0], uvHi = uv[0];
+        for (const Vec2f &t : uv) {
+            uvLo = Vec2f(std::min(uvLo.x, t.x), std::min(uvLo.y, t.y));
+            uvHi = Vec2f(std::max(uvHi.x, t.x), std::max(uvHi.y, t.y));
+        }
+        uvOffset = uvLo;
+        for (int k = 0; k < 2; k++) {
+            uvScale[k] = uvHi[k] > uvLo[k] ? (uvHi[k] - uvLo[k]) / 65535.0f : 1.0f;
+        }
+        quantizedUv.resize(uv.size() * 2);
+        for (size_t i = 0; i < uv.size(); i++) {
+            for (int k = 0; k < 2; k++) {
+                float q = (uv[i][k] - uvLo[k]) / uvScale[k];
+                quantizedUv[i * 2 + k] = (uint16_t) std::max(0.0f, std::min(65535.0f, roundf(q)));
+            }
+        }
+    }
+
+    // Planes, bounds and clusters from the positions as they will be drawn
+    for (size_t v = 0; v < verts.size(); v++) {
+        verts[v] = getPosition((int) v);
+    }
+    computeBounds();
+    computeFacePlanes();
+    Stream().swap(positionX);
+    Stream().swap(positionY);
+    Stream().swap(positionZ);
+    for (Cluster &cluster : clusters) {
+        cluster = MakeCluster(verts, indices, cluster.firstIndex, (size_t) cluster.firstIndex + cluster.indexCount);
+    }
+    for (Lod &lod : lods) {
+        for (Cluster &cluster : lod.clusters) {
+            cluster = MakeCluster(verts, lod.indices, cluster.firstIndex, (size_t) cluster.firstIndex + cluster.indexCount);
+        }
+    }
+
+    if (!keepFloat) {
+        std::vector<Vec3f>().swap(verts);
+        std::vector<Triangle>().swap(polygons);
+        std::vector<Vec2f>().swap(uv);
+        std::vector<Vec3f>().swap(norms);
+        std::vector<std::vector<Vec3i> >().swap(faces);
+        std::vector<Vec3i>().swap(faces_n);
+    }
+}
+
+bool Mesh::isQuantized() const {
+    return !quantizedPositions.empty();
+}
+
+int Mesh::getVertexCount() const {
+    return isQuantized() ? (int)(quantizedPositions.size() / 3) : (int) verts.size();
+}
+
+int Mesh::getUvCount() const {
+    return isQuantized() ? (int)(quantizedUv.size() / 2) : (int) uv.size();
+}
+
+Vec2f Mesh::getUv(int index) const {
+    if (!isQuantized()) return uv[index];
+    const uint16_t *q = &quantizedUv[(size_t) index * 2];
+    return Vec2f(uvOffset.x + q[0] * uvScale.x, uvOffset.y + q[1] * uvScale.y);
+}
+
+Vec3f Mesh::getPosition(int vertex) const {
+    if (!isQuantized()) return verts[vertex];
+    const uint16_t *q = &quantizedPositions[(size_t) vertex * 3];
+    return Vec3f(quantizedOffset.x + q[0] * quantizedScale.x, quantizedOffset.y + q[1] * quantizedScale.y,
+                 quantizedOffset.z + q[2] * quantizedScale.z);
+}
+
+Matrix Mesh::getDequantizeMatrix() const {
+    Matrix matrix = Matrix(4, 4, 0);
+    matrix(0,0) = quantizedScale.x;
+    matrix(1,1) = quantizedScale.y;
+    matrix(2,2) = quantizedScale.z;
+    matrix(3,0) = quantizedOffset.x;
+    matrix(3,1) = quantizedOffset.y;
+    matrix(3,2) = quantizedOffset.z;
+    matrix(3,3) = 1.0f;
+    return matrix;
+}
+
+const Matrix &Mesh::getWorldMatrix() const {
+    if (worldDirty) {
+        worldMatrix = Matrix_MakeTransform(rotX, rotY, rotZ, translationX, translationY, translationZ);
+        worldDirty = false;
+    }
+    return worldMatrix;
+}
+
+int Scene::addMesh(const Mesh &mesh) {
+    meshes.push_back(mesh);
+    return (int) meshes.size() - 1;
+}
+
+int Scene::addNode(int mesh, int parent) {
+    assert(parent < (int) nodes.size() && mesh < (int) meshes.size());
+    Node node = { parent, mesh, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, Vec3f(1, 1, 1) };
+    nodes.push_back(node);
+    worldMatrices.push_back(Matrix_MakeIdentity());
+    dirty.push_back(1);
+    return (int) nodes.size() - 1;
+}
+
+void Scene::setRotation(int node, float rotationX, float rotationY, float rotationZ) {
+    nodes[node].rotX = rotationX;
+    nodes[node].rotY = rotationY;
+    nodes[node].rotZ = rotationZ;
+    dirty[node] = 1;
+}
+
+void Scene::setTranslation(int node, float trX, float trY, float trZ) {
+    nodes[node].translationX = trX;
+    nodes[node].translationY = trY;
+    nodes[node].translationZ = trZ;
+    dirty[node] = 1;
+}
+
+void Scene::setColor(int node, Vec3f color) {
+    nodes[node].color = color;
+}
+
+int Scene::getNodeCount() const {
+    return (int) nodes.size();
+}
+
+int Scene::getMesh(int node) const {
+    return nodes[node].mesh;
+}
+
+int Scene::getParent(int node) const {
+    return nodes[node].parent;
+}
+
+Vec3f Scene::getColor(int node) const {
+    return nodes[node].color;
+}
+
+const Matrix &Scene::getWorldMatrix(int node) const {
+    return worldMatrices[node];
+}
+
+// Parents come first, so a parent recomputed in this pass is seen as dirty by all of its children
+void Scene::update() const {
+    TraceScope traceUpdate("scene update", "stage");
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const Node &node = nodes[i];
+        dirty[i] = dirty[i] || (node.parent >= 0 && dirty[node.parent]);
+        if (dirty[i]) {
+            Matrix local = Matrix_MakeTransform(node.rotX, node.rotY, node.rotZ, node.translationX, node.translationY, node.translationZ);
+            worldMatrices[i] = node.parent >= 0 ? local * worldMatrices[node.parent] : local;
+        }
+    }
+    std::fill(dirty.begin(), dirty.end(), 0);
+}
+
+const Matrix &Device::getProjectionMatrix(float fov) {
+    if (fov != projectionFov) {
+        float fNear = 0.1f;
+        float fFar = 1000.0f;
+        float fFov = fov;
+        float fAspectRatio = (float)height / (float)width;
+        float fFovRad = 1.0f / tanf(fFov * 0.5f / 180.0f * M_PI);
+        projectionMatrix = Matrix(4, 4, 0);
+        projectionMatrix(0,0) = fAspectRatio * fFovRad;
+        projectionMatrix(1,1) = fFovRad;
+        projectionMatrix(2,2) = fFar / (fFar - fNear);
+        projectionMatrix(3,2) = (-fFar * fNear) / (fFar - fNear);
+        projectionMatrix(2,3) = 1.0f;
+        projectionMatrix(3,3) = 0.0f;
+        projectionFov = fov;
+    }
+    return projectionMatrix;
+}
+
 void Device::DrawPoint(Vec2f p, Vec3f color) {
     if (p.x >= 0 && p.x < width && p.y >= 0 && p.y < height) {
-        int index = ((int) p.x + (int) p.y * width);
-        if (index < width * height) {
-            framebuffer[index].x = color.x;
-            framebuffer[index].y = color.y;
-            framebuffer[index].z = color.z;
-        }
+        framebuffer.set((int) p.x, (int) p.y, framebuffer.pack(color));
     }
 }
 
@@ -354,7 +948,7 @@ float Interpolate(float min, float max, float gradient)
 // drawing line between 2 points from left to right
 // papb -> pcpd
 // pa, pb, pc, pd must then be sorted before
-void Device::ProcessScanLine(int y, Vec2f pa, Vec2f pb, Vec2f pc, Vec2f pd, Vec3f color)
+void Device::ProcessScanLine(int y, Vec2f pa, Vec2f pb, Vec2f pc, Vec2f pd, ColorBuffer::Packed color)
 {
     // Thanks to current Y, we can compute the gradient to compute others values like
     // the starting X (sx) and ending X (ex) to draw between
@@ -366,10 +960,7 @@ void Device::ProcessScanLine(int y, Vec2f pa, Vec2f pb, Vec2f pc, Vec2f pd, Vec3
     int ex = (int)Interpolate(pc.x, pd.x, gradient2);
 
     // drawing a line from left (sx) to right (ex)
-    for (int x = sx; x < ex; x++)
-    {
-        DrawPoint(Vec2f(x, y), color);
-    }
+    framebuffer.fillSpan(y, sx, ex, color);
 }
 
 void Device::FillTriangle(Vec2f p1, Vec2f p2, Vec2f p3, Vec3f color) {
@@ -394,6 +985,9 @@ void Device::FillTriangle(Vec2f p1, Vec2f p2, Vec2f p3, Vec3f color) {
         p2 = p1;
         p1 = temp;
     }
+    // Packed once for the whole triangle
+    ColorBuffer::Packed packed = framebuffer.pack(color);
+
     float dP1P2, dP1P3;
     if (p2.y - p1.y > 0)
         dP1P2 = (p2.x - p1.x) / (p2.y - p1.y);
@@ -410,11 +1004,11 @@ void Device::FillTriangle(Vec2f p1, Vec2f p2, Vec2f p3, Vec3f color) {
         {
             if (y < (int)p2.y)
             {
-                ProcessScanLine(y, p1, p3, p1, p2, color);
+                ProcessScanLine(y, p1, p3, p1, p2, packed);
             }
             else
             {
-                ProcessScanLine(y, p1, p3, p2, p3, color);
+                ProcessScanLine(y, p1, p3, p2, p3, packed);
             }
         }
     }
@@ -424,11 +1018,11 @@ void Device::FillTriangle(Vec2f p1, Vec2f p2, Vec2f p3, Vec3f color) {
         {
             if (y < (int)p2.y)
             {
-                ProcessScanLine(y, p1, p2, p1, p3, color);
+                ProcessScanLine(y, p1, p2, p1, p3, packed);
             }
             else
             {
-                ProcessScanLine(y, p2, p3, p1, p3, color);
+                ProcessScanLine(y, p2, p3, p1, p3, packed);
             }
         }
     }
@@ -440,117 +1034,269 @@ Vec3f GetColour(float lum)
     return Vec3f(lum, lum, lum);
 }
 
-void Device::render(Camera camera, std::vector<Mesh> meshes, float fov) {
-
-    float fNear = 0.1f;
-    float fFar = 1000.0f;
-    float fFov = fov;
-    float fAspectRatio = (float)height / (float)width;
-    float fFovRad = 1.0f / tanf(fFov * 0.5f / 180.0f * M_PI);
-    Matrix projectionMatrix = Matrix(4, 4, 0);
-    projectionMatrix(0,0) = fAspectRatio * fFovRad;
-    projectionMatrix(1,1) = fFovRad;
-    projectionMatrix(2,2) = fFar / (fFar - fNear);
-    projectionMatrix(3,2) = (-fFar * fNear) / (fFar - fNear);
-    projectionMatrix(2,3) = 1.0f;
-    projectionMatrix(3,3) = 0.0f;
-    Vec3f light_direction = { 0.0f, 0.0f, -1.0f };
-    float l = sqrtf(light_direction.x*light_direction.x + light_direction.y*light_direction.y + light_direction.z*light_direction.z);
-    light_direction.x /= l; light_direction.y /= l; light_direction.z /= l;
+void Device::render(const Camera &camera, const std::vector<Mesh> &meshes, float fov) {
 
-    std::vector<Triangle> trianglesToRaster;
+    TraceScope traceRender("render", "stage");
 
-    for (auto mesh : meshes) {
-
-        Matrix matRotZ = Matrix_MakeRotationZ(mesh.rotZ), matRotX = Matrix_MakeRotationX(mesh.rotX), matTran = Matrix_MakeTranslation(mesh.translationX, mesh.translationY, mesh.translationZ);
-        Matrix matRotY = Matrix_MakeRotationY(mesh.rotY);
-        Matrix worldMatrix = Matrix_MakeIdentity();
+    const Matrix &projectionMatrix = getProjectionMatrix(fov);
+    std::vector<Triangle> trianglesToRaster;
+    for (size_t i = 0; i < meshes.size(); i++) {
+        projectMesh(camera, meshes[i], meshes[i].getWorldMatrix(), Vec3f(1, 1, 1), projectionMatrix, (int) i, trianglesToRaster);
+    }
+    rasterize(trianglesToRaster);
+}
 
-        Vec3f vUp = Vec3f(0.f, 1.f, 0.f);
-        Vec3f vTarget = camera.position + camera.target;
+void Device::render(const Camera &camera, const Scene &scene, float fov) {
 
-        Matrix matCamera = Matrix_PointAt(camera.position, vTarget, vUp);
-        Matrix viewMatrix = Matrix_Inverse(matCamera);
+    TraceScope traceRender("render", "stage");
 
+    scene.update();
+    const Matrix &projectionMatrix = getProjectionMatrix(fov);
+    std::vector<Triangle> trianglesToRaster;
+    for (int node = 0; node < scene.getNodeCount(); node++) {
+        int mesh = scene.getMesh(node);
+        if (mesh >= 0) {
+            projectMesh(camera, scene.meshes[mesh], scene.getWorldMatrix(node), scene.getColor(node), projectionMatrix, node, trianglesToRaster);
+        }
+    }
+    rasterize(trianglesToRaster);
+}
 
-        for (Triangle tri : mesh.polygons) {
+// The bounds are projected as a disc at the distance of their center, world matrices being rotations and translations
+int Device::selectLod(const Camera &camera, const Mesh &mesh, const Matrix &worldMatrix, const Matrix &projectionMatrix) const {
+    if (mesh.lods.empty() || lodPixelsPerTriangle <= 0) return 0;
+    Vec3f center = MultiplyMatrixVector(mesh.boundsCenter, worldMatrix) - camera.position;
+    float distance = Vector_Length(center);
+    if (distance <= mesh.boundsRadius) return 0;
+    float radius = mesh.boundsRadius / distance * (float) projectionMatrix(1, 1) * 0.5f * (float) height;
+    float wanted = (float) M_PI * radius * radius / lodPixelsPerTriangle;
+    int level = 0;
+    while (level + 1 < mesh.getLodCount() && (float) mesh.getTriangleCount(level + 1) >= wanted) {
+        level++;
+    }
+    return level;
+}
 
-            Triangle projectedTriangle, triTransformed, triViewed;
+// Points through the affine m, count being a multiple of 4 and the streams 16 byte aligned
+static void TransformPositions(const float *x, const float *y, const float *z, size_t count, const Matrix &m,
+                               float *outX, float *outY, float *outZ)
+{
+    float e[4][3];
+    for (int row = 0; row < 4; row++) {
+        for (int col = 0; col < 3; col++) e[row][col] = (float) m(row, col);
+    }
+#ifdef SOFTENGINE_SIMD_X86
+    __m128 m00 = _mm_set1_ps(e[0][0]), m01 = _mm_set1_ps(e[0][1]), m02 = _mm_set1_ps(e[0][2]);
+    __m128 m10 = _mm_set1_ps(e[1][0]), m11 = _mm_set1_ps(e[1][1]), m12 = _mm_set1_ps(e[1][2]);
+    __m128 m20 = _mm_set1_ps(e[2][0]), m21 = _mm_set1_ps(e[2][1]), m22 = _mm_set1_ps(e[2][2]);
+    __m128 m30 = _mm_set1_ps(e[3][0]), m31 = _mm_set1_ps(e[3][1]), m32 = _mm_set1_ps(e[3][2]);
+    for (size_t i = 0; i < count; i += 4) {
+        __m128 vx = _mm_load_ps(x + i), vy = _mm_load_ps(y + i), vz = _mm_load_ps(z + i);
+        _mm_store_ps(outX + i, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, m00), _mm_mul_ps(vy, m10)), _mm_mul_ps(vz, m20)), m30));
+        _mm_store_ps(outY + i, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, m01), _mm_mul_ps(vy, m11)), _mm_mul_ps(vz, m21)), m31));
+        _mm_store_ps(outZ + i, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, m02), _mm_mul_ps(vy, m12)), _mm_mul_ps(vz, m22)), m32));
+    }
+#else
+    for (size_t i = 0; i < count; i++) {
+        outX[i] = x[i] * e[0][0] + y[i] * e[1][0] + z[i] * e[2][0] + e[3][0];
+        outY[i] = x[i] * e[0][1] + y[i] * e[1][1] + z[i] * e[2][1] + e[3][1];
+        outZ[i] = x[i] * e[0][2] + y[i] * e[1][2] + z[i] * e[2][2] + e[3][2];
+    }
+#endif
+}
 
-            worldMatrix = Matrix_MakeIdentity();
-            worldMatrix = matRotZ * matRotY * matRotX;
-            worldMatrix = worldMatrix * matTran;
+// False when the cluster's sphere is outside one of the frustum's side planes or behind the near plane, or when
+// its normal cone faces away from the camera, localCamera being the camera position in the space of the mesh
+static bool ClusterVisible(const Mesh::Cluster &cluster, Vec3f localCamera, const Matrix &worldMatrix,
+                           const Matrix &viewMatrix, const Matrix &projectionMatrix)
+{
+    // Every normal n is within the cone, so n.(p - camera) over the sphere is at least |d| cos(angle(axis, d) + half angle) - radius
+    if (cluster.coneCos > 0.0f) {
+        Vec3f d = cluster.center - localCamera;
+        float along = d * cluster.coneAxis;
+        float across = sqrtf(std::max(0.0f, d * d - along * along));
+        if (along * cluster.coneCos - across * cluster.coneSin >= cluster.radius) return false;
+    }
 
-            triTransformed.vertices[0] = MultiplyMatrixVector(tri.vertices[0], worldMatrix);
-            triTransformed.vertices[1] = MultiplyMatrixVector(tri.vertices[1], worldMatrix);
-            triTransformed.vertices[2] = MultiplyMatrixVector(tri.vertices[2], worldMatrix);
+    Vec3f center = MultiplyMatrixVector(MultiplyMatrixVector(cluster.center, worldMatrix), viewMatrix);
+    float nearZ = -(float) projectionMatrix(3, 2) / (float) projectionMatrix(2, 2);
+    if (center.z + cluster.radius < nearZ) return false;
+    // Side planes through the eye, |x| * P(0,0) <= z and |y| * P(1,1) <= z
+    float sx = (float) projectionMatrix(0, 0), sy = (float) projectionMatrix(1, 1);
+    if ((sx * fabsf(center.x) - center.z) > cluster.radius * sqrtf(sx * sx + 1.0f)) return false;
+    if ((sy * fabsf(center.y) - center.z) > cluster.radius * sqrtf(sy * sy + 1.0f)) return false;
+    return true;
+}
 
-            Vec3f normal, line1, line2;
-            line1 = triTransformed.vertices[1] - triTransformed.vertices[0];
-            line2 = triTransformed.vertices[2] - triTransformed.vertices[0];
+// Appends the front facing triangles of mesh, shaded, tinted by color and in screen space, to trianglesToRaster
+void Device::projectMesh(const Camera &camera, const Mesh &mesh, const Matrix &worldMatrix, Vec3f color,
+                         const Matrix &projectionMatrix, int meshIndex, std::vector<Triangle> &trianglesToRaster) {
 
-            normal = Vector_CrossProduct(line1, line2).normalize();
+    TraceScope traceMesh("transform mesh", "mesh", meshIndex);
 
-            float l = sqrtf(normal.x*normal.x + normal.y*normal.y + normal.z*normal.z);
-            normal.x /= l; normal.y /= l; normal.z /= l;
+    const Matrix &viewMatrix = camera.getViewMatrix();
+    Vec3f light_direction = { 0.0f, 0.0f, -1.0f };
+    float l = sqrtf(light_direction.x*light_direction.x + light_direction.y*light_direction.y + light_direction.z*light_direction.z);
+    light_direction.x /= l; light_direction.y /= l; light_direction.z /= l;
 
-            Vec3f vCameraRay = triTransformed.vertices[0] - camera.position;
+    // Shading and projection of one front facing triangle already in world space, normal being its world normal
+    auto project = [&](Triangle &triTransformed, const Vec3f &normal) {
 
-            if (normal * vCameraRay < 0.0f) {
+        Triangle projectedTriangle, triViewed;
 
-                float dp = std::max(0.1f, light_direction * normal);
-                projectedTriangle.color = GetColour(dp);
+        float dp = std::max(0.1f, light_direction * normal);
+        Vec3f shade = GetColour(dp);
+        projectedTriangle.color = Vec3f(shade.x * color.x, shade.y * color.y, shade.z * color.z);
 
-                Vec3f vOffsetView = Vec3f(1, 1, 0);
+        Vec3f vOffsetView = Vec3f(1, 1, 0);
 
-                triViewed.vertices[0] = MultiplyMatrixVector(triTransformed.vertices[0], viewMatrix);
-                triViewed.vertices[1] = MultiplyMatrixVector(triTransformed.vertices[1], viewMatrix);
-                triViewed.vertices[2] = MultiplyMatrixVector(triTransformed.vertices[2], viewMatrix);
+        triViewed.vertices[0] = MultiplyMatrixVector(triTransformed.vertices[0], viewMatrix);
+        triViewed.vertices[1] = MultiplyMatrixVector(triTransformed.vertices[1], viewMatrix);
+        triViewed.vertices[2] = MultiplyMatrixVector(triTransformed.vertices[2], viewMatrix);
 
-                projectedTriangle.vertices[0] = MultiplyMatrixVector(triViewed.vertices[0], projectionMatrix);
-                projectedTriangle.vertices[1] = MultiplyMatrixVector(triViewed.vertices[1], projectionMatrix);
-                projectedTriangle.vertices[2] = MultiplyMatrixVector(triViewed.vertices[2], projectionMatrix);
+        // Clip space, then the perspective divide
+        for (int k = 0; k < 3; k++) {
+            const Vec3f &viewed = triViewed.vertices[k];
+            Vec4f clip = MultiplyMatrixVector(Vec4f(viewed.x, viewed.y, viewed.z, 1.0f), projectionMatrix);
+            projectedTriangle.vertices[k] = Vec3f(clip.x / clip.w, clip.y / clip.w, clip.z / clip.w);
+        }
 
-                projectedTriangle.vertices[0] = Vector_Div(projectedTriangle.vertices[0],
-                                                           projectedTriangle.vertices[0].w);
-                projectedTriangle.vertices[1] = Vector_Div(projectedTriangle.vertices[1],
-                                                           projectedTriangle.vertices[1].w);
-                projectedTriangle.vertices[2] = Vector_Div(projectedTriangle.vertices[2],
-                                                           projectedTriangle.vertices[2].w);
+        projectedTriangle.vertices[0].x *= -1.0f;
+        projectedTriangle.vertices[1].x *= -1.0f;
+        projectedTriangle.vertices[2].x *= -1.0f;
+        projectedTriangle.vertices[0].y *= -1.0f;
+        projectedTriangle.vertices[1].y *= -1.0f;
+        projectedTriangle.vertices[2].y *= -1.0f;
+
+        projectedTriangle.vertices[0] = projectedTriangle.vertices[0] + vOffsetView;
+        projectedTriangle.vertices[1] = projectedTriangle.vertices[1] + vOffsetView;
+        projectedTriangle.vertices[2] = projectedTriangle.vertices[2] + vOffsetView;
+        projectedTriangle.vertices[0].x *= 0.5f * (float) width;
+        projectedTriangle.vertices[0].y *= 0.5f * (float) height;
+        projectedTriangle.vertices[1].x *= 0.5f * (float) width;
+        projectedTriangle.vertices[1].y *= 0.5f * (float) height;
+        projectedTriangle.vertices[2].x *= 0.5f * (float) width;
+        projectedTriangle.vertices[2].y *= 0.5f * (float) height;
+
+        trianglesToRaster.push_back(projectedTriangle);
+    };
+
+    if (mesh.indices.empty()) {
+        for (const Triangle &tri : mesh.polygons) {
+            Triangle triTransformed;
+            triTransformed.vertices[0] = MultiplyMatrixVector(tri.vertices[0], worldMatrix);
+            triTransformed.vertices[1] = MultiplyMatrixVector(tri.vertices[1], worldMatrix);
+            triTransformed.vertices[2] = MultiplyMatrixVector(tri.vertices[2], worldMatrix);
+            Vec3f line1 = triTransformed.vertices[1] - triTransformed.vertices[0];
+            Vec3f line2 = triTransformed.vertices[2] - triTransformed.vertices[0];
+            Vec3f normal = Vector_CrossProduct(line1, line2).normalize();
+            if (normal * (triTransformed.vertices[0] - camera.position) < 0.0f) {
+                project(triTransformed, normal);
+            }
+        }
+        return;
+    }
 
-                projectedTriangle.vertices[0].x *= -1.0f;
-                projectedTriangle.vertices[1].x *= -1.0f;
-                projectedTriangle.vertices[2].x *= -1.0f;
-                projectedTriangle.vertices[0].y *= -1.0f;
-                projectedTriangle.vertices[1].y *= -1.0f;
-                projectedTriangle.vertices[2].y *= -1.0f;
+    // Back faces are rejected in object space against the precomputed planes of the selected level, with the camera
+    // brought into the space of the mesh once, and each corner of a front facing triangle is picked by index from the
+    // vertices transformed once on first use, or from the streamed transform, while the plane's normal is rotated
+    // for shading.
+    int level = selectLod(camera, mesh, worldMatrix, projectionMatrix);
+    const std::vector<int> &indices = level == 0 ? mesh.indices : mesh.lods[level - 1].indices;
+    const std::vector<Mesh::Cluster> &clusters = level == 0 ? mesh.clusters : mesh.lods[level - 1].clusters;
+    const std::vector<uint32_t> &faceNormals = level == 0 ? mesh.faceNormals : mesh.lods[level - 1].faceNormals;
+    const std::vector<float> &faceDistances = level == 0 ? mesh.faceDistances : mesh.lods[level - 1].faceDistances;
+    Vec3f localCamera = MultiplyMatrixVector(camera.position, Matrix_Inverse(worldMatrix));
+    // Quantized positions are transformed by the world matrix with the dequantization folded in
+    Matrix dequantizeWorld = Matrix(4, 4, 0);
+    if (mesh.isQuantized()) {
+        Matrix dequantize = mesh.getDequantizeMatrix();
+        Matrix world = worldMatrix;
+        dequantizeWorld = dequantize * world;
+    }
+    const uint16_t *quantized = mesh.isQuantized() ? mesh.quantizedPositions.data() : NULL;
+    // Whole clusters are culled before any of their triangles is looked at
+    visibleClusters.clear();
+    size_t visibleIndices = clusters.empty() ? indices.size() : 0;
+    for (size_t c = 0; c < clusters.size(); c++) {
+        if (ClusterVisible(clusters[c], localCamera, worldMatrix, viewMatrix, projectionMatrix)) {
+            visibleClusters.push_back((int) c);
+            visibleIndices += clusters[c].indexCount;
+        }
+    }
+    // The streams hold every vertex of the full detail mesh, so they are only worth transforming when most of it is drawn
+    bool streamed = quantized == NULL && !mesh.positionX.empty() && level == 0 &&
+                    visibleIndices >= indices.size() * STREAM_MIN_VISIBLE;
+    if (streamed) {
+        size_t count = mesh.positionX.size();
+        worldX.resize(count);
+        worldY.resize(count);
+        worldZ.resize(count);
+        TransformPositions(mesh.positionX.data(), mesh.positionY.data(), mesh.positionZ.data(), count, worldMatrix,
+                           worldX.data(), worldY.data(), worldZ.data());
+    }
+    else {
+        worldVertices.resize(mesh.getVertexCount());
+        transformedVertices.assign(mesh.getVertexCount(), 0);
+    }
+    auto projectRange = [&](size_t first, size_t end) {
+        for (size_t i = first; i + 2 < end; i += 3) {
+            size_t face = i / 3;
+            Vec3f normal = OctahedralDecode(faceNormals[face]);
+            if (normal * localCamera <= faceDistances[face]) continue;
+            Triangle triTransformed;
+            for (int k = 0; k < 3; k++) {
+                int v = indices[i + k];
+                if (streamed) {
+                    triTransformed.vertices[k] = Vec3f(worldX[v], worldY[v], worldZ[v]);
+                    continue;
+                }
+                if (!transformedVertices[v]) {
+                    if (quantized != NULL) {
+                        const uint16_t *q = quantized + (size_t) v * 3;
+                        worldVertices[v] = MultiplyMatrixVector(Vec3f(q[0], q[1], q[2]), dequantizeWorld);
+                    }
+                    else {
+                        worldVertices[v] = MultiplyMatrixVector(mesh.verts[v], worldMatrix);
+                    }
+                    transformedVertices[v] = 1;
+                }
+                triTransformed.vertices[k] = worldVertices[v];
+            }
+            project(triTransformed, RotateVector(normal, worldMatrix));
+        }
+    };
 
-                projectedTriangle.vertices[0] = projectedTriangle.vertices[0] + vOffsetView;
-                projectedTriangle.vertices[1] = projectedTriangle.vertices[1] + vOffsetView;
-                projectedTriangle.vertices[2] = projectedTriangle.vertices[2] + vOffsetView;
-                projectedTriangle.vertices[0].x *= 0.5f * (float) width;
-                projectedTriangle.vertices[0].y *= 0.5f * (float) height;
-                projectedTriangle.vertices[1].x *= 0.5f * (float) width;
-                projectedTriangle.vertices[1].y *= 0.5f * (float) height;
-                projectedTriangle.vertices[2].x *= 0.5f * (float) width;
-                projectedTriangle.vertices[2].y *= 0.5f * (float) height;
+    if (clusters.empty()) {
+        projectRange(0, indices.size());
+        return;
+    }
+    for (int c : visibleClusters) {
+        projectRange(clusters[c].firstIndex, (size_t) clusters[c].firstIndex + clusters[c].indexCount);
+    }
+}
 
-                trianglesToRaster.push_back(projectedTriangle);
+void Device::rasterize(std::vector<Triangle> &trianglesToRaster) {
 
-            }
+    // Back to front: the average depth is turned into a key once per triangle and only indices are sorted
+    std::vector<uint32_t> order(trianglesToRaster.size());
+    {
+        TraceScope traceSort("sort", "stage");
+        std::vector<uint32_t> keys(trianglesToRaster.size());
+        for (size_t i = 0; i < trianglesToRaster.size(); i++) {
+            Triangle &t = trianglesToRaster[i];
+            float z = (t.vertices[0].z + t.vertices[1].z + t.vertices[2].z) / 3.0f;
+            keys[i] = ~FloatSortKey(z);
+            order[i] = (uint32_t) i;
         }
-
+        RadixSort(keys, order);
     }
-    // Sort triangles from back to front
-        sort(trianglesToRaster.begin(), trianglesToRaster.end(), [](Triangle &t1, Triangle &t2)
-        {
-            float z1 = (t1.vertices[0].z + t1.vertices[1].z + t1.vertices[2].z) / 3.0f;
-            float z2 = (t2.vertices[0].z + t2.vertices[1].z + t2.vertices[2].z) / 3.0f;
-            return z1 > z2;
-        });
 
-        for (auto &triProjected : trianglesToRaster)
+    {
+        TraceScope traceRaster("raster", "stage");
+        for (uint32_t index : order)
         {
+            Triangle &triProjected = trianglesToRaster[index];
             float color1 =
                     0.25f + ((float) ((rand() % 2000 + 1) % trianglesToRaster.size()) / trianglesToRaster.size()) * 0.75f;
             float color2 =
@@ -567,88 +1313,141 @@ void Device::render(Camera camera, std::vector<Mesh> meshes, float fov) {
                     //           Vec3f(color1, color2, color3));
                          triProjected.color);
         }
+    }
 }
 
-void Device::render_prep(Camera cameraInit, std::vector<Mesh> meshes, float fov) {
+bool Device::render_frame(const Camera &camera, const Scene &scene, float fov, SequenceWriter &writer) {
+    TraceScope traceFrame("render_frame", "frame", writer.getFrameCount());
+    clear(Vec3f(0, 0, 0));
+    render(camera, scene, fov);
+    resolve(sequencePixmap);
+    return writer.writeFrame(sequencePixmap.data());
+}
 
-    Camera camera = Camera();
-    camera = cameraInit;
+void Device::render_async(const Camera &camera, const Scene &scene, float fov, AsyncImageWriter &writer, const std::string &filename) {
+    TraceScope traceFrame("render_async", "frame");
+    clear(Vec3f(0, 0, 0));
+    render(camera, scene, fov);
+
+    std::vector<unsigned char> pixmap = writer.acquire();
+    resolve(pixmap);
+
+    int w = width;
+    int h = height;
+    JpegEncoder jpeg = jpegEncoder;
+    ImageFormat format = image_format_from_filename(filename);
+    writer.submit(std::move(pixmap), [=](const std::vector<unsigned char> &pixels) {
+        if (!write_image(filename.c_str(), format, jpeg, w, h, 3, pixels.data())) {
+            std::cerr << "Failed to write " << filename << std::endl;
+        }
+    });
+}
+
+// Each file is only opened once its image is encoded, so a failure leaves the other output as it was
+void Device::render_prep(const Camera &cameraInit, const Scene &scene, float fov) {
 
-    render(camera, meshes, fov);
+    TraceScope traceRenderPrep("render_prep", "frame");
 
-    std::vector<unsigned char> pixmap(width*height*3);
-    for (size_t i = 0; i < height*width; ++i) {
-        Vec3f &c = framebuffer[i];
-        float max = std::max(c[0], std::max(c[1], c[2]));
-        if (max>1) c = c*(1./max);
-        for (size_t j = 0; j<3; j++) {
-            pixmap[i*3+j] = (unsigned char)(255 * std::max(0.f, std::min(1.f, framebuffer[i][j])));
+    std::vector<unsigned char> pixmap;
+    std::vector<unsigned char> pixmap_l_r;
+    renderStereo(cameraInit, scene, fov, pixmap, pixmap_l_r);
+    {
+        TraceScope traceEncode("encode", "stage");
+        if (!jpegEncoder.write("out.jpg", width, height, 3, pixmap.data())) {
+            std::cerr << "Failed to write out.jpg" << std::endl;
         }
     }
-    stbi_write_jpg("out.jpg", width, height, 3, pixmap.data(), 100);
+    {
+        TraceScope traceEncode("encode 3d", "stage");
+        if (!jpegEncoder.write("out_3d.jpg", width, height, 3, pixmap_l_r.data())) {
+            std::cerr << "Failed to write out_3d.jpg" << std::endl;
+        }
+    }
+}
 
-    for (int i = 0 ; i < width * height ; i++) {
-        framebuffer[i] = Vec3f(1, 1, 1);
+void Device::render_prep(const Camera &cameraInit, const Scene &scene, float fov, const ImageSink &out, const ImageSink &out3d) {
+
+    TraceScope traceRenderPrep("render_prep", "frame");
+
+    std::vector<unsigned char> pixmap;
+    std::vector<unsigned char> pixmap_l_r;
+    renderStereo(cameraInit, scene, fov, pixmap, pixmap_l_r);
+    {
+        TraceScope traceEncode("encode", "stage");
+        if (!jpegEncoder.write(out, width, height, 3, pixmap.data())) {
+            std::cerr << "Failed to write out.jpg" << std::endl;
+        }
     }
+    {
+        TraceScope traceEncode("encode 3d", "stage");
+        if (!jpegEncoder.write(out3d, width, height, 3, pixmap_l_r.data())) {
+            std::cerr << "Failed to write out_3d.jpg" << std::endl;
+        }
+    }
+}
+
+void Device::renderStereo(const Camera &cameraInit, const Scene &scene, float fov, std::vector<unsigned char> &pixmap,
+                          std::vector<unsigned char> &pixmap_l_r) {
+
+
+    Camera camera = Camera();
+    camera = cameraInit;
+
+    render(camera, scene, fov);
+
+    resolve(pixmap);
+
+    clear(Vec3f(1, 1, 1));
 
     camera.position = Vec3f(cameraInit.position.x - CAMERA_DISTANCE, cameraInit.position.y, cameraInit.position.z);
     camera.target = cameraInit.target;
 
-    render(camera, meshes, fov);
-
-    std::vector<unsigned char> pixmap_l(width*height*3);
-    for (size_t i = 0; i < height*width; ++i) {
-        Vec3f &c = framebuffer[i];
-        float grey_level = (c[0] + c[1] + c[2]) / 3;
-        //float max = std::max(c[0], std::max(c[1], c[2]));
-        //if (max>1) c = c*(1./max);
-        for (size_t j = 0; j<3; j++) {
-            if (j == 0) {
-                pixmap_l[i*3+j] = (unsigned char)(255 * std::max(0.f, std::min(1.f, grey_level)));
-                //pixmap_l[i*3+j] = (unsigned char)(255 * std::max(0.f, std::min(1.f, c[0])));
-            }
-            else {
-                pixmap_l[i*3+j] = (unsigned char)(0.f);
-            }
+    render(camera, scene, fov);
+
+    std::vector<unsigned char> pixmap_l;
+    resolve(pixmap_l);
+    {
+        TraceScope traceConvert("convert left", "stage");
+        for (size_t i = 0; i < height*width; ++i) {
+            unsigned char *c = &pixmap_l[i*3];
+            c[0] = (unsigned char)((c[0] + c[1] + c[2]) / 3);
+            c[1] = 0;
+            c[2] = 0;
         }
     }
 
-    for (int i = 0 ; i < width * height ; i++) {
-        framebuffer[i] = Vec3f(1, 1, 1);
-    }
+    clear(Vec3f(1, 1, 1));
 
     camera.position = Vec3f(cameraInit.position.x + CAMERA_DISTANCE, cameraInit.position.y, cameraInit.position.z);
     camera.target = cameraInit.target;
 
-    render(camera, meshes, fov);
-
-    std::vector<unsigned char> pixmap_r(width*height*3);
-    for (size_t i = 0; i < height*width; ++i) {
-        Vec3f &c = framebuffer[i];
-        float grey_level = (c[0] + c[1] + c[2]) / 3;
-        //float max = std::max(c[0], std::max(c[1], c[2]));
-        //if (max>1) c = c*(1./max);
-        for (size_t j = 0; j<3; j++) {
-            if (j != 0) {
-                pixmap_r[i*3+j] = (unsigned char)(255 * std::max(0.f, std::min(1.f, grey_level)));
-            }
-            else {
-                pixmap_r[i*3+j] = (unsigned char)(0.f);
-            }
+    render(camera, scene, fov);
+
+    std::vector<unsigned char> pixmap_r;
+    resolve(pixmap_r);
+    {
+        TraceScope traceConvert("convert right", "stage");
+        for (size_t i = 0; i < height*width; ++i) {
+            unsigned char *c = &pixmap_r[i*3];
+            unsigned char grey_level = (unsigned char)((c[0] + c[1] + c[2]) / 3);
+            c[0] = 0;
+            c[1] = grey_level;
+            c[2] = grey_level;
         }
     }
 
-    std::vector<unsigned char> pixmap_l_r(width*height*3);
-    for (size_t i = 0; i < height*width; ++i) {
-        for (size_t j = 0; j<3; j++) {
-            if (j == 0) {
-                pixmap_l_r[i*3+j] = pixmap_l[i*3+j];
-            }
-            else{
-                pixmap_l_r[i*3+j] = pixmap_r[i*3+j];
+    pixmap_l_r.resize(width*height*3);
+    {
+        TraceScope traceMerge("merge anaglyph", "stage");
+        for (size_t i = 0; i < height*width; ++i) {
+            for (size_t j = 0; j<3; j++) {
+                if (j == 0) {
+                    pixmap_l_r[i*3+j] = pixmap_l[i*3+j];
+                }
+                else{
+                    pixmap_l_r[i*3+j] = pixmap_r[i*3+j];
+                }
             }
         }
     }
-
-    stbi_write_jpg("out_3d.jpg", width, height, 3, pixmap_l_r.data(), 100);
 }
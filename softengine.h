@@ -1,7 +1,15 @@
 #ifndef PROJET_SOFTENGINE_H
 #define PROJET_SOFTENGINE_H
 
+#include <string>
+
+#include "alignedallocator.h"
+#include "asyncwriter.h"
+#include "colorbuffer.h"
 #include "geometry.h"
+#include "imagewriter.h"
+#include "matrix.h"
+#include "sequencewriter.h"
 
 namespace SoftEngine {
     class Camera {
@@ -9,6 +17,16 @@ namespace SoftEngine {
     public:
         Vec3f position;
         Vec3f target;
+
+        Camera();
+        // Rebuilt only when position or target changed since the last call
+        const Matrix &getViewMatrix() const;
+
+    private:
+        mutable Matrix viewMatrix;
+        mutable Vec3f viewPosition;
+        mutable Vec3f viewTarget;
+        mutable bool viewValid;
     };
 
     class Triangle {
@@ -29,6 +47,57 @@ namespace SoftEngine {
         std::vector<std::vector<Vec3i> > faces;
         std::vector<Vec3f> norms;
         std::vector<Vec2f> uv;
+        // Corners of polygons as indices in verts, three per triangle
+        std::vector<int> indices;
+        // Plane of each triangle of indices in object space: unit normal, octahedral encoded, and the dot product of
+        // the decoded normal with the first corner. The normal is also what shades the triangle once rotated into the world
+        std::vector<uint32_t> faceNormals;
+        std::vector<float> faceDistances;
+
+        // verts as structure-of-arrays streams for vector loops, filled by buildPositionStreams and empty until then.
+        // Each starts on a 32 byte boundary and is padded to a multiple of STREAM_WIDTH with copies of the last vertex
+        typedef std::vector<float, AlignedAllocator<float, 32> > Stream;
+        static const int STREAM_WIDTH = 8;
+        Stream positionX;
+        Stream positionY;
+        Stream positionZ;
+
+        // Filled by quantize: three 16 bit coordinates per vertex within the bounding box, position being
+        // quantizedOffset + q * quantizedScale, and two per entry of uv within their own box in the same way
+        std::vector<uint16_t> quantizedPositions;
+        Vec3f quantizedOffset;
+        Vec3f quantizedScale;
+        std::vector<uint16_t> quantizedUv;
+        Vec2f uvOffset;
+        Vec2f uvScale;
+        // Sphere around verts, set when the mesh is loaded
+        Vec3f boundsCenter;
+        float boundsRadius;
+
+        // A run of about a hundred neighbouring triangles, culled as a whole when its sphere is off screen or when
+        // every triangle in it faces away, which the cone around its face normals tells from the camera position
+        struct Cluster {
+            int firstIndex;
+            int indexCount;
+            Vec3f center;
+            float radius;
+            Vec3f coneAxis;
+            // Cosine and sine of the cone half angle, a cone of 90 degrees or more is never back facing
+            float coneCos;
+            float coneSin;
+        };
+        // Clusters of indices from buildClusters, empty when the mesh is drawn triangle by triangle
+        std::vector<Cluster> clusters;
+
+        // A simplified version of indices, with its own face planes and clusters
+        struct Lod {
+            std::vector<int> indices;
+            std::vector<uint32_t> faceNormals;
+            std::vector<float> faceDistances;
+            std::vector<Cluster> clusters;
+        };
+        // Levels of detail from buildLods, lods[i] being level i + 1 and level 0 the full indices
+        std::vector<Lod> lods;
 
         float rotX;
         float rotY;
@@ -39,8 +108,88 @@ namespace SoftEngine {
 
         Mesh();
         Mesh(const char *filename, int method);
+        // Change the rotation and translation through these so the cached world matrix follows
         void setRotation(float rotationX, float rotationY, float rotationZ);
         void setTranslation(float trX, float trY, float trZ);
+        // Rebuilt on the first call after setRotation or setTranslation
+        const Matrix &getWorldMatrix() const;
+        void computeBounds();
+        // Face planes of indices and of every level of detail, kept up to date by the methods below
+        void computeFacePlanes();
+        // Reorders the triangles for vertex cache reuse, then renumbers verts in the order the triangles use them.
+        // faces, faces_n and polygons follow; call it before buildLods so the levels inherit the order
+        void optimizeVertexOrder(int cacheSize = 16);
+        // Up to levels simplified levels, each keeping about ratio of the triangles of the one before
+        void buildLods(int levels = 4, float ratio = 0.5f);
+        // Groups the triangles of indices and of every level of detail into clusters, reordering them so each cluster
+        // is a consecutive range
+        void buildClusters(int maxTriangles = 64, int maxVertices = 64);
+        // Kept in step with verts by optimizeVertexOrder once built. Freed by quantize, and not built for a quantized
+        // mesh, which projectMesh never draws from them
+        void buildPositionStreams();
+        // Stores positions and uv quantized to 16 bits and frees the position streams, and unless keepFloat also
+        // frees verts, polygons, uv, norms, faces and faces_n. Face planes and clusters are rebuilt from the quantized
+        // positions so culling agrees with what is drawn. Call it last: the methods above need verts.
+        void quantize(bool keepFloat = false);
+        bool isQuantized() const;
+        int getVertexCount() const;
+        Vec3f getPosition(int vertex) const;
+        // Texture coordinate at an index of uv, from quantizedUv once quantized
+        int getUvCount() const;
+        Vec2f getUv(int index) const;
+        // Turns quantized coordinates into object space, to be folded into the world matrix
+        Matrix getDequantizeMatrix() const;
+        int getLodCount() const;
+        // Triangles drawn at level, 0 being the full mesh
+        size_t getTriangleCount(int level) const;
+
+    private:
+        mutable Matrix worldMatrix;
+        mutable bool worldDirty;
+
+        void reorderTriangles(const std::vector<int> &order);
+    };
+
+    // Meshes placed as a hierarchy of nodes, each with a rotation and translation relative to its parent (or to the
+    // world for a root). A node is an instance of one of the scene's meshes with its own transform and color, so a mesh
+    // is stored once however many nodes draw it, and the transform of a Mesh in meshes is not used. Nodes live in one
+    // array where a parent always comes before its children, so update() propagates world matrices in a single forward
+    // pass, recomputing only the nodes that changed since the last update and their descendants.
+    class Scene {
+
+    public:
+        std::vector<Mesh> meshes;
+
+        // Returns the index of the mesh in meshes
+        int addMesh(const Mesh &mesh);
+        // mesh is an index in meshes or -1 for a node that only carries a transform, parent an existing node or -1
+        int addNode(int mesh, int parent = -1);
+        void setRotation(int node, float rotationX, float rotationY, float rotationZ);
+        void setTranslation(int node, float trX, float trY, float trZ);
+        // Multiplies the shading of the node's triangles, white by default
+        void setColor(int node, Vec3f color);
+
+        int getNodeCount() const;
+        int getMesh(int node) const;
+        int getParent(int node) const;
+        Vec3f getColor(int node) const;
+        // Valid after update()
+        const Matrix &getWorldMatrix(int node) const;
+        void update() const;
+
+    private:
+        struct Node {
+            int parent;
+            int mesh;
+            float rotX, rotY, rotZ;
+            float translationX, translationY, translationZ;
+            Vec3f color;
+        };
+
+        std::vector<Node> nodes;
+        mutable std::vector<Matrix> worldMatrices;
+        // Set by the setters, then by update() for every node it recomputed
+        mutable std::vector<char> dirty;
     };
 
     class Device {
@@ -48,18 +197,60 @@ namespace SoftEngine {
 
     public:
 
-        std::vector<Vec3f> framebuffer;
+        ColorBuffer framebuffer;
         int width;
         int height;
+        // Built once and reused by every render_prep call
+        JpegEncoder jpegEncoder;
+        // Screen area per triangle a mesh is drawn at: the coarsest level of detail that still has one triangle for
+        // this many pixels of the projected bounds is used
+        float lodPixelsPerTriangle;
 
-        Device(int, int);
+        Device(int, int, ColorFormat format = ColorFormat::RGBA8, ColorLayout layout = ColorLayout::Tiled);
+        void setJpegOptions(int quality, ChromaSubsampling subsampling);
+        void clear(Vec3f color);
+        void resolve(std::vector<unsigned char> &pixmap);
         void DrawPoint(Vec2f p, Vec3f color);
         void DrawLine(Vec2f p1, Vec2f p2, Vec3f color);
-        void ProcessScanLine(int y, Vec2f pa, Vec2f pb, Vec2f pc, Vec2f pd, Vec3f color);
+        void ProcessScanLine(int y, Vec2f pa, Vec2f pb, Vec2f pc, Vec2f pd, ColorBuffer::Packed color);
         void DrawTriangle(Vec2f p1, Vec2f p2, Vec2f p3, Vec3f color);
         void FillTriangle(Vec2f p1, Vec2f p2, Vec2f p3, Vec3f color);
-        void render(Camera camera, std::vector<Mesh> meshes, float fov);
-        void render_prep(Camera cameraInit, std::vector<Mesh> meshes, float fov);
+        void render(const Camera &camera, const std::vector<Mesh> &meshes, float fov);
+        void render(const Camera &camera, const Scene &scene, float fov);
+        void render_prep(const Camera &cameraInit, const Scene &scene, float fov);
+        // Same as above, but the plain and anaglyph JPEGs go to the given sinks instead of out.jpg and out_3d.jpg
+        void render_prep(const Camera &cameraInit, const Scene &scene, float fov, const ImageSink &out, const ImageSink &out3d);
+        // Renders one frame on a black background and appends it to a raw Y4M/PPM sequence
+        bool render_frame(const Camera &camera, const Scene &scene, float fov, SequenceWriter &writer);
+        // Renders one frame on a black background and queues it on writer in the format given by the file extension,
+        // returning as soon as the pixels are handed over so the next frame renders while this one encodes
+        void render_async(const Camera &camera, const Scene &scene, float fov, AsyncImageWriter &writer, const std::string &filename);
+
+    private:
+        // Reused between render_frame calls so a sequence does not allocate per frame
+        std::vector<unsigned char> sequencePixmap;
+        // Projection for projectionFov, rebuilt by getProjectionMatrix when the field of view changes
+        Matrix projectionMatrix;
+        float projectionFov;
+
+        const Matrix &getProjectionMatrix(float fov);
+        // Scratch for the vertices of one mesh transformed by projectMesh, and which of them are when culling clusters
+        std::vector<Vec3f> worldVertices;
+        std::vector<char> transformedVertices;
+        // Indices in the clusters of the level being drawn of those that passed culling
+        std::vector<int> visibleClusters;
+        // Scratch for all the vertices of a mesh with position streams, transformed at once
+        Mesh::Stream worldX;
+        Mesh::Stream worldY;
+        Mesh::Stream worldZ;
+
+        // Renders the plain image into pixmap, then the two eyes merged into the red and cyan anaglyph pixmap_l_r
+        void renderStereo(const Camera &cameraInit, const Scene &scene, float fov, std::vector<unsigned char> &pixmap,
+                          std::vector<unsigned char> &pixmap_l_r);
+        int selectLod(const Camera &camera, const Mesh &mesh, const Matrix &worldMatrix, const Matrix &projectionMatrix) const;
+        void projectMesh(const Camera &camera, const Mesh &mesh, const Matrix &worldMatrix, Vec3f color,
+                         const Matrix &projectionMatrix, int meshIndex, std::vector<Triangle> &trianglesToRaster);
+        void rasterize(std::vector<Triangle> &trianglesToRaster);
     };
 
 };
@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <cstdlib>
+
+#include "threadpool.h"
+#include "trace.h"
+
+using namespace SoftEngine;
+
+// Set while a thread runs a job, nested parallelFor calls then run inline instead of deadlocking
+static thread_local bool insideJob = false;
+
+ThreadPool::ThreadPool(int threads) {
+    batch = Batch();
+    next.store(0);
+    pending.store(0);
+    generation = 0;
+    active = 0;
+    stopping = false;
+    for (int i = 1; i < threads; i++) {
+        names.push_back("worker " + std::to_string(i));
+    }
+    for (int i = 1; i < threads; i++) {
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this, i - 1));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+int ThreadPool::size() const {
+    return (int)workers.size() + 1;
+}
+
+ThreadPool &ThreadPool::shared() {
+    static ThreadPool pool([]() {
+        const char *env = getenv("SOFTENGINE_THREADS");
+        int threads = env != NULL ? atoi(env) : (int)std::thread::hardware_concurrency();
+        return std::max(1, threads);
+    }());
+    return pool;
+}
+
+void ThreadPool::parallelFor(const char *name, int count, const std::function<void(int)> &job) {
+    if (count <= 0) return;
+    Batch current = { &job, name, count };
+    if (workers.empty() || count == 1 || insideJob) {
+        for (int i = 0; i < count; i++) {
+            TraceScope traceJob(name, "job", i);
+            job(i);
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> submitLock(submitMutex);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        batch = current;
+        next.store(0);
+        pending.store(count);
+        generation++;
+    }
+    wake.notify_all();
+
+    runJobs(current);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return pending.load() == 0 && active == 0; });
+    batch = Batch();
+}
+
+void ThreadPool::workerLoop(int index) {
+    Trace::setThreadName(names[index].c_str());
+    unsigned seen = 0;
+    for (;;) {
+        Batch current;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            current = batch;
+            active++;
+        }
+        runJobs(current);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            active--;
+        }
+        done.notify_all();
+    }
+}
+
+// Jobs are claimed one index at a time, so uneven jobs balance themselves across threads
+void ThreadPool::runJobs(const Batch &current) {
+    insideJob = true;
+    for (;;) {
+        int i = next.fetch_add(1);
+        if (i >= current.count) break;
+        {
+            TraceScope traceJob(current.name, "job", i);
+            (*current.job)(i);
+        }
+        if (pending.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(mutex);
+            done.notify_all();
+        }
+    }
+    insideJob = false;
+}
@@ -0,0 +1,55 @@
+#ifndef PROJET_THREADPOOL_H
+#define PROJET_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace SoftEngine {
+
+    // Fixed set of worker threads running index-based jobs. The calling thread takes part in
+    // every batch, so a pool of size 1 has no workers and simply runs jobs inline.
+    class ThreadPool {
+
+    public:
+        explicit ThreadPool(int threads);
+        ~ThreadPool();
+
+        int size() const;
+        // Runs job(0) ... job(count - 1) and returns once all of them are done; each job is traced as name
+        void parallelFor(const char *name, int count, const std::function<void(int)> &job);
+
+        // Pool sized from SOFTENGINE_THREADS, or the hardware concurrency when unset
+        static ThreadPool &shared();
+
+    private:
+        struct Batch {
+            const std::function<void(int)> *job;
+            const char *name;
+            int count;
+        };
+
+        std::vector<std::thread> workers;
+        std::vector<std::string> names;
+        std::mutex submitMutex;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        Batch batch;
+        std::atomic<int> next;
+        std::atomic<int> pending;
+        unsigned generation;
+        int active;
+        bool stopping;
+
+        void workerLoop(int index);
+        void runJobs(const Batch &current);
+    };
+
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "trace.h"
+
+#define TRACE_MAX_THREADS 256
+
+using namespace SoftEngine;
+
+static std::vector<Trace::Event> events;
+static std::atomic<size_t> cursor(0);
+static std::atomic<size_t> dropped(0);
+static std::atomic<bool> active(false);
+static std::atomic<int> threadCount(0);
+static std::atomic<const char *> threadNames[TRACE_MAX_THREADS];
+static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+void Trace::start(size_t capacity) {
+    events = std::vector<Event>(capacity);
+    cursor.store(0);
+    dropped.store(0);
+    active.store(true, std::memory_order_release);
+}
+
+void Trace::stop() {
+    active.store(false, std::memory_order_release);
+}
+
+bool Trace::enabled() {
+    return active.load(std::memory_order_relaxed);
+}
+
+// Nanoseconds since the program started
+long long Trace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+// Small dense id per thread, handed out on first use
+int Trace::threadId() {
+    static thread_local int id = threadCount.fetch_add(1, std::memory_order_relaxed);
+    return id;
+}
+
+void Trace::setThreadName(const char *name) {
+    int id = threadId();
+    if (id < TRACE_MAX_THREADS) {
+        threadNames[id].store(name, std::memory_order_relaxed);
+    }
+}
+
+void Trace::record(const char *name, const char *category, int arg, long long begin, long long end) {
+    if (!enabled()) return;
+    size_t slot = cursor.fetch_add(1, std::memory_order_relaxed);
+    if (slot >= events.size()) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Event &e = events[slot];
+    e.name = name;
+    e.category = category;
+    e.arg = arg;
+    e.tid = threadId();
+    e.begin = begin;
+    e.end = end;
+}
+
+bool Trace::write(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        std::fprintf(stderr, "Failed to open %s\n", filename);
+        return false;
+    }
+    size_t count = std::min(cursor.load(), events.size());
+    std::fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    std::fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"SoftEngine\"}}");
+    int threads = std::min(threadCount.load(), TRACE_MAX_THREADS);
+    for (int i = 0; i < threads; i++) {
+        const char *threadName = threadNames[i].load();
+        if (threadName != NULL) {
+            std::fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                         i, threadName);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        const Event &e = events[i];
+        std::fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                     e.name, e.category, e.tid, e.begin / 1000.0, (e.end - e.begin) / 1000.0);
+        if (e.arg >= 0) {
+            std::fprintf(f, ",\"args\":{\"index\":%d}", e.arg);
+        }
+        std::fprintf(f, "}");
+    }
+    std::fprintf(f, "\n]}\n");
+    fclose(f);
+    if (dropped.load() > 0) {
+        std::fprintf(stderr, "Trace buffer full, %zu events dropped\n", dropped.load());
+    }
+    return true;
+}
+
+TraceScope::TraceScope(const char *name, const char *category, int arg) {
+    this->name = name;
+    this->category = category;
+    this->arg = arg;
+    begin = Trace::enabled() ? Trace::now() : 0;
+}
+
+TraceScope::~TraceScope() {
+    if (Trace::enabled()) {
+        Trace::record(name, category, arg, begin, Trace::now());
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef PROJET_TRACE_H
+#define PROJET_TRACE_H
+
+#include <cstddef>
+
+namespace SoftEngine {
+
+    // Records spans as Chrome trace events ("ph":"X"), to be opened in chrome://tracing or ui.perfetto.dev.
+    // Events land in a buffer allocated by start(): a thread claims a slot with one atomic increment
+    // and fills it in, so recording never locks. Events past the capacity are dropped and counted.
+    // start(), stop() and write() must not run while other threads are recording.
+    class Trace {
+
+    public:
+        struct Event {
+            const char *name;
+            const char *category;
+            int arg;
+            int tid;
+            long long begin;
+            long long end;
+        };
+
+        static void start(size_t capacity = 1 << 16);
+        static void stop();
+        static bool enabled();
+        static bool write(const char *filename);
+
+        static long long now();
+        static int threadId();
+        static void setThreadName(const char *name);
+        static void record(const char *name, const char *category, int arg, long long begin, long long end);
+    };
+
+    // Records a span covering its own lifetime; arg (mesh index, job index...) is kept when >= 0
+    class TraceScope {
+
+    public:
+        TraceScope(const char *name, const char *category, int arg = -1);
+        ~TraceScope();
+
+    private:
+        const char *name;
+        const char *category;
+        int arg;
+        long long begin;
+    };
+
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "vertexcache.h"
+
+using namespace SoftEngine;
+
+std::vector<int> SoftEngine::VertexCacheOrder(const std::vector<int> &indices, size_t vertexCount, int cacheSize) {
+    size_t triangleCount = indices.size() / 3;
+
+    // Triangles around each vertex, as ranges of one array
+    std::vector<int> live(vertexCount, 0);
+    for (size_t i = 0; i < triangleCount * 3; i++) live[indices[i]]++;
+    std::vector<size_t> firstTriangle(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; v++) firstTriangle[v + 1] = firstTriangle[v] + live[v];
+    std::vector<int> adjacency(triangleCount * 3);
+    std::vector<size_t> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+    for (size_t i = 0; i < triangleCount * 3; i++) adjacency[fill[indices[i]]++] = (int)(i / 3);
+
+    // A vertex is in the cache while fewer than cacheSize vertices entered it after, timestamps starting past that
+    std::vector<int> cacheTime(vertexCount, 0);
+    int time = cacheSize + 1;
+    std::vector<char> emitted(triangleCount, 0);
+    std::vector<int> deadEnds;
+    std::vector<int> candidates;
+    std::vector<int> order;
+    order.reserve(triangleCount);
+    size_t cursor = 0;
+
+    // When the fan ends with no candidate left, go back to a recently used vertex, else to the next one in input order
+    auto skipDeadEnd = [&]() {
+        while (!deadEnds.empty()) {
+            int v = deadEnds.back();
+            deadEnds.pop_back();
+            if (live[v] > 0) return v;
+        }
+        for (; cursor < vertexCount; cursor++) {
+            if (live[cursor] > 0) return (int) cursor;
+        }
+        return -1;
+    };
+
+    int fan = skipDeadEnd();
+    while (fan >= 0) {
+        candidates.clear();
+        for (size_t a = firstTriangle[fan]; a < firstTriangle[fan + 1]; a++) {
+            int t = adjacency[a];
+            if (emitted[t]) continue;
+            emitted[t] = 1;
+            order.push_back(t);
+            for (int k = 0; k < 3; k++) {
+                int v = indices[t * 3 + k];
+                deadEnds.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - cacheTime[v] > cacheSize) {
+                    cacheTime[v] = time++;
+                }
+            }
+        }
+
+        // The candidate that stays longest in the cache, provided its remaining triangles do not push it out
+        int next = -1;
+        int best = 0;
+        for (int v : candidates) {
+            if (live[v] <= 0) continue;
+            int priority = 0;
+            if (time - cacheTime[v] + 2 * live[v] <= cacheSize) priority = time - cacheTime[v];
+            if (priority > best) {
+                best = priority;
+                next = v;
+            }
+        }
+        fan = next >= 0 ? next : skipDeadEnd();
+    }
+    return order;
+}
+
+std::vector<int> SoftEngine::VertexFetchRemap(const std::vector<int> &indices, size_t vertexCount) {
+    std::vector<int> remap(vertexCount, -1);
+    int next = 0;
+    for (int index : indices) {
+        if (remap[index] < 0) remap[index] = next++;
+    }
+    for (size_t v = 0; v < vertexCount; v++) {
+        if (remap[v] < 0) remap[v] = next++;
+    }
+    return remap;
+}
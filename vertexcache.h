@@ -0,0 +1,19 @@
+#ifndef PROJET_VERTEXCACHE_H
+#define PROJET_VERTEXCACHE_H
+
+#include <cstddef>
+#include <vector>
+
+namespace SoftEngine {
+
+    // Order in which to draw the triangles of indices so consecutive triangles reuse recently transformed vertices,
+    // with Tipsify (Sander, Nehab and Barczak 2007): triangles are fanned around one vertex at a time, the next
+    // vertex being a neighbour still in a FIFO cache of cacheSize entries. Linear in the number of triangles.
+    std::vector<int> VertexCacheOrder(const std::vector<int> &indices, size_t vertexCount, int cacheSize = 16);
+
+    // New index of every vertex, numbering them in the order indices first uses them; unused vertices go last
+    std::vector<int> VertexFetchRemap(const std::vector<int> &indices, size_t vertexCount);
+
+};
+
+#endif